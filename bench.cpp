@@ -0,0 +1,417 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "board.hpp"
+#include "octree.hpp"
+
+/* a benchmark runs for at least this many milliseconds per repetition */
+#define BENCH_MIN_MS 20
+/* repetitions of every benchmark, the minimum and median of which are kept */
+#define BENCH_REPS   7
+
+/*
+ * Benchmarks of the paths the model spends its time in, printed as one
+ * tab-separated line each:
+ *
+ *     name  params  items  iterations  min_ns  median_ns  ns_per_item
+ *
+ * where the times are of one iteration and ns_per_item is the median over
+ * the items (cells or points) an iteration handles.  Every input is made
+ * from a fixed seed, so two builds can be compared line by line.
+ */
+
+typedef std::chrono::steady_clock bench_clock;
+
+static int reps = BENCH_REPS;
+static const char *filter = NULL;
+
+/* keeps the compiler from dropping work whose result is never used */
+static volatile unsigned long sink;
+
+/*
+ * Time f() over repetitions, each long enough to be above the noise of the
+ * clock, after a warm-up repetition which also finds how many iterations
+ * that takes.
+ */
+template <typename F>
+static void
+bench (const char *name, const std::string &params, double items, F f)
+{
+    std::vector<double> times;
+    unsigned long iterations = 1;
+
+    if (filter && !strstr(name, filter))
+        return;
+
+    for (;;) {
+        bench_clock::time_point start = bench_clock::now();
+        for (unsigned long i = 0; i < iterations; i++)
+            f();
+        double ms = std::chrono::duration<double, std::milli>(
+                bench_clock::now() - start).count();
+        if (ms >= BENCH_MIN_MS)
+            break;
+        iterations *= ms > 0 ? std::max(2.0, 1.2 * BENCH_MIN_MS / ms) : 10;
+    }
+
+    for (int r = 0; r < reps; r++) {
+        bench_clock::time_point start = bench_clock::now();
+        for (unsigned long i = 0; i < iterations; i++)
+            f();
+        times.push_back(std::chrono::duration<double, std::nano>(
+                bench_clock::now() - start).count() / iterations);
+    }
+    std::sort(times.begin(), times.end());
+
+    double median = times[times.size() / 2];
+    printf("%s\t%s\t%.0f\t%lu\t%.0f\t%.0f\t%.4f\n", name, params.c_str(),
+           items, iterations, times[0], median, median / items);
+    fflush(stdout);
+}
+
+/* a cube board with cells living at random with some density */
+static Board
+random_board (int size, double density, const Rule &rule, uint64_t seed)
+{
+    Board board(size, size, size, rule.layers());
+    Rng random(seed);
+
+    for (int x = 0; x < size; x++)
+        for (int y = 0; y < size; y++)
+            for (int z = 0; z < size; z++)
+                if (random() < density * 2147483648.0)
+                    board.set(x, y, z, LIVE);
+    return board;
+}
+
+static std::string
+board_params (const char *rule, int size, double density)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "rule=%s size=%d density=%.2f",
+             rule, size, density);
+    return text;
+}
+
+static void
+bench_step (ThreadPool &pool)
+{
+    static const char *rules[] = { "W19-26", "B5/S4-5" };
+    static const int sizes[] = { 32, 64, 128, 256 };
+    static const double densities[] = { 0.02, 0.1, 0.3 };
+
+    for (const char *text : rules) {
+        Rule rule;
+        parse_rule(text, rule);
+        for (int size : sizes) {
+            for (double density : densities) {
+                Board curr = random_board(size, density, rule, 1);
+                Board next(size, size, size, rule.layers());
+                double cells = (double) size * size * size;
+                std::string params = board_params(text, size, density);
+
+                srand(1);
+                bench("step_board", params, cells, [&]() {
+                    next.clear_chunks();
+                    step_board(curr, next, rule);
+                });
+                bench("step_board_pool", params, cells, [&]() {
+                    next.clear_chunks();
+                    step_board(curr, next, rule, pool, 1);
+                });
+            }
+        }
+    }
+}
+
+static void
+bench_neighbors ()
+{
+    static const int sizes[] = { 32, 64 };
+
+    for (int size : sizes) {
+        Rule rule;
+        Board board = random_board(size, 0.1, rule, 2);
+        double cells = (double) size * size * size;
+
+        bench("cell_neighbors", board_params("W19-26", size, 0.1), cells,
+              [&]() {
+            unsigned long total = 0;
+            for (int x = 0; x < size; x++)
+                for (int y = 0; y < size; y++)
+                    for (int z = 0; z < size; z++)
+                        total += cell_neighbors(board, x, y, z, LIVE);
+            sink = total;
+        });
+    }
+}
+
+/* points spread evenly over a cube, or gathered around a few centers */
+static std::vector<vec3>
+random_points (int count, float size, int clusters, uint64_t seed)
+{
+    std::vector<vec3> points;
+    std::vector<vec3> centers;
+    Rng random(seed);
+    auto unit = [&]() { return random() / 2147483648.0f; };
+
+    for (int c = 0; c < clusters; c++)
+        centers.push_back(vec3(unit() * size, unit() * size, unit() * size));
+
+    for (int i = 0; i < count; i++) {
+        vec3 p;
+        if (clusters == 0) {
+            p = vec3(unit() * size, unit() * size, unit() * size);
+        }
+        else {
+            /* a sum of uniforms is near enough to a normal distribution */
+            vec3 &c = centers[i % clusters];
+            float spread = size / 32;
+            p = vec3(c.x + (unit() + unit() + unit() - 1.5f) * spread,
+                     c.y + (unit() + unit() + unit() - 1.5f) * spread,
+                     c.z + (unit() + unit() + unit() - 1.5f) * spread);
+        }
+        points.push_back(vec3(
+                std::min(std::max(std::floor(p.x), 0.0f), size - 1),
+                std::min(std::max(std::floor(p.y), 0.0f), size - 1),
+                std::min(std::max(std::floor(p.z), 0.0f), size - 1)));
+    }
+    return points;
+}
+
+static void
+bench_octree ()
+{
+    static const int counts[] = { 10000, 100000, 1000000 };
+    const float size = 256;
+    BoundingBox region(vec3(0, 0, 0), vec3(size, size, size));
+
+    for (int count : counts) {
+        for (int clusters : { 0, 16 }) {
+            std::vector<vec3> points = random_points(count, size, clusters, 3);
+            std::vector<vec3> scratch;
+            char params[64];
+            snprintf(params, sizeof(params), "points=%d %s", count,
+                     clusters ? "clustered" : "uniform");
+
+            /* the build partitions its points in place, so each gets a copy */
+            bench("octree_build", params, count, [&]() {
+                scratch = points;
+                Octree tree(region, scratch);
+                sink = tree.size();
+            });
+        }
+    }
+}
+
+/* the same objects in any order */
+static bool
+same_objects (std::vector<vec3> a, std::vector<vec3> b)
+{
+    auto before = [](const vec3 &p, const vec3 &q) {
+        return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+    };
+    std::sort(a.begin(), a.end(), before);
+    std::sort(b.begin(), b.end(), before);
+    return a == b;
+}
+
+/* points and centers are whole cells, so this is exact however it's done */
+static float
+distance2 (vec3 a, vec3 b)
+{
+    vec3 d = a - b;
+    return d.x * d.x + d.y * d.y + d.z * d.z;
+}
+
+/* exit unless a query of the tree gave what scanning every point did */
+static void
+check (bool same, const char *query, int i)
+{
+    if (same)
+        return;
+    fprintf(stderr, "%s %d differs from a scan of every point\n", query, i);
+    exit(1);
+}
+
+/*
+ * Box, radius and nearest queries around random points, one at a time and
+ * batched across the pool.  Before they are timed the answers of both are
+ * checked against a scan of every point of the tree.
+ */
+static void
+bench_queries (ThreadPool &pool)
+{
+    const int count = 100000, queries = 256, k = 8;
+    const float size = 256, radius = 8;
+    BoundingBox region(vec3(0, 0, 0), vec3(size, size, size));
+
+    for (int clusters : { 0, 16 }) {
+        std::vector<vec3> points = random_points(count, size, clusters, 5);
+        std::vector<vec3> scratch = points;
+        Octree tree(region, scratch);
+        std::vector<vec3> centers = random_points(queries, size, clusters, 6);
+        std::vector<BoundingBox> boxes;
+        for (auto &c : centers)
+            boxes.push_back(BoundingBox(c - radius, c + radius));
+
+        std::vector<std::vector<vec3>> boxed, round, near;
+        tree.query_box(boxes, boxed, pool);
+        tree.query_radius(centers, radius, round, pool);
+        tree.nearest(centers, k, near, pool);
+        for (int i = 0; i < queries; i++) {
+            std::vector<vec3> in_box, in_radius, list;
+            std::vector<float> scanned, found;
+            for (auto &p : points) {
+                float d = distance2(p, centers[i]);
+                if (boxes[i].contains(p))
+                    in_box.push_back(p);
+                if (d <= radius * radius)
+                    in_radius.push_back(p);
+                scanned.push_back(d);
+            }
+            std::sort(scanned.begin(), scanned.end());
+            scanned.resize(k);
+
+            tree.query_box(boxes[i], list);
+            check(same_objects(list, in_box), "query_box", i);
+            check(same_objects(boxed[i], in_box), "batched query_box", i);
+            list.clear();
+            tree.query_radius(centers[i], radius, list);
+            check(same_objects(list, in_radius), "query_radius", i);
+            check(same_objects(round[i], in_radius), "batched query_radius",
+                  i);
+
+            /* ties may pick other points, but never at other distances */
+            list.clear();
+            tree.nearest(centers[i], k, list);
+            for (auto &p : list)
+                found.push_back(distance2(p, centers[i]));
+            check(found == scanned, "nearest", i);
+            check(near[i] == list, "batched nearest", i);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "points=%d %s radius=%.0f k=%d",
+                 count, clusters ? "clustered" : "uniform", radius, k);
+        std::vector<vec3> list;
+        bench("octree_query_box", params, queries, [&]() {
+            for (auto &box : boxes) {
+                list.clear();
+                tree.query_box(box, list);
+            }
+            sink = list.size();
+        });
+        bench("octree_query_box_pool", params, queries, [&]() {
+            tree.query_box(boxes, boxed, pool);
+            sink = boxed.size();
+        });
+        bench("octree_query_radius", params, queries, [&]() {
+            for (auto &center : centers) {
+                list.clear();
+                tree.query_radius(center, radius, list);
+            }
+            sink = list.size();
+        });
+        bench("octree_query_radius_pool", params, queries, [&]() {
+            tree.query_radius(centers, radius, round, pool);
+            sink = round.size();
+        });
+        bench("octree_nearest", params, queries, [&]() {
+            for (auto &center : centers) {
+                list.clear();
+                tree.nearest(center, k, list);
+            }
+            sink = list.size();
+        });
+        bench("octree_nearest_pool", params, queries, [&]() {
+            tree.nearest(centers, k, near, pool);
+            sink = near.size();
+        });
+    }
+}
+
+/*
+ * The collect of the main loop: the cells of the tree inside of the view,
+ * gathered the way draw_cube gathers them, with the camera where the
+ * window first puts it.
+ */
+static void
+bench_collect ()
+{
+    static const int sizes[] = { 64, 128, 256 };
+
+    for (int size : sizes) {
+        Rule rule;
+        Board board = random_board(size, 0.1, rule, 4);
+        std::vector<vec3> cells;
+        std::vector<vec3> positions;
+
+        board.each_live([&](int x, int y, int z) {
+            cells.push_back(vec3(x, y, z));
+        });
+        Octree tree(BoundingBox(vec3(0, 0, 0), vec3(size, size, size)), cells);
+
+        vec3 center(size / 2, size / 2, size / 2);
+        mat4 view = lookAt(center + vec3(size * 5, 0, 0), center,
+                           vec3(0, 1, 0));
+        mat4 projection = perspective(radians(45.0f), 16.0f / 9.0f,
+                                      0.1f, 1000.0f);
+        Frustum frustum(projection * view);
+
+        bench("collect", board_params("W19-26", size, 0.1), tree.size(),
+              [&]() {
+            positions.clear();
+            tree.visible(frustum, [&](vec3 pos) {
+                positions.push_back(pos);
+            });
+            sink = positions.size();
+        });
+    }
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r repetitions] [-t threads] [name]\n"
+                    "  -r  repetitions of every benchmark, %d by default\n"
+                    "  -t  threads of the _pool benchmarks, 0 for every core\n"
+                    "  name  only run benchmarks with this in their name\n",
+                    prog, BENCH_REPS);
+    exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:")) != -1) {
+        switch (opt) {
+            case 'r': reps = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (reps <= 0)
+        usage(argv[0]);
+    if (optind < argc)
+        filter = argv[optind];
+
+    ThreadPool pool(threads);
+
+    printf("# name\tparams\titems\titerations\tmin_ns\tmedian_ns"
+           "\tns_per_item\n");
+    bench_step(pool);
+    bench_neighbors();
+    bench_octree();
+    bench_queries(pool);
+    bench_collect();
+    return 0;
+}
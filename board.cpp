@@ -0,0 +1,1331 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include "board.hpp"
+#include "profile.hpp"
+
+/*
+ * Rows are counted several at a time when the CPU has vector registers.  GCC
+ * lowers the shifts and bitwise operations on these types to SSE2 or AVX2.
+ */
+#if defined(__AVX2__)
+#define BOARD_SIMD
+typedef uint64_t lanes_t __attribute__((vector_size(32)));
+#elif defined(__SSE2__)
+#define BOARD_SIMD
+typedef uint64_t lanes_t __attribute__((vector_size(16)));
+#else
+typedef uint64_t lanes_t;
+#endif
+
+static const int LANES = sizeof(lanes_t) / sizeof(uint64_t);
+
+static const size_t CACHE_LINE = 64;
+
+Board::Board (int size_x, int size_y, int size_z, int layers)
+    : size_x(size_x)
+    , size_y(size_y)
+    , size_z(size_z)
+    , zwords((size_z + 63) / 64)
+    , pad_x(size_x + 2)
+    , pad_y(size_y + 2)
+    , pad_w(zwords + 2)
+    , plane((size_t)pad_x * pad_y)
+    , chunks_x((size_x + CHUNK - 1) / CHUNK)
+    , chunks_y((size_y + CHUNK - 1) / CHUNK)
+    , layers(layers)
+    , layer_words(pad_w * plane)
+    , words(NULL)
+    , nwords(layers * layer_words)
+    , chunks((size_t)chunks_x * chunks_y * zwords, 0)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, CACHE_LINE, nwords * sizeof(uint64_t)) != 0) {
+        fprintf(stderr, "Could not allocate a %dx%dx%d board\n",
+                size_x, size_y, size_z);
+        exit(1);
+    }
+    words = (uint64_t*) mem;
+    clear();
+}
+
+Board::Board (const Board &other)
+    : Board(other.size_x, other.size_y, other.size_z, other.layers)
+{
+    copy(other);
+}
+
+Board::~Board ()
+{
+    free(words);
+}
+
+Board &
+Board::operator= (Board other)
+{
+    swap(other);
+    return *this;
+}
+
+void
+Board::swap (Board &other)
+{
+    std::swap(size_x, other.size_x);
+    std::swap(size_y, other.size_y);
+    std::swap(size_z, other.size_z);
+    std::swap(zwords, other.zwords);
+    std::swap(pad_x, other.pad_x);
+    std::swap(pad_y, other.pad_y);
+    std::swap(pad_w, other.pad_w);
+    std::swap(plane, other.plane);
+    std::swap(chunks_x, other.chunks_x);
+    std::swap(chunks_y, other.chunks_y);
+    std::swap(layers, other.layers);
+    std::swap(layer_words, other.layer_words);
+    std::swap(words, other.words);
+    std::swap(nwords, other.nwords);
+    chunks.swap(other.chunks);
+}
+
+/*
+ * Any position within one cell of the board is valid and is dead if it lies
+ * outside of it.
+ */
+int
+Board::get (int x, int y, int z) const
+{
+    int state = (*row(x, y, z >> 6) >> (z & 63)) & 1;
+    int age = 0;
+
+    for (int l = 1; l < layers; l++)
+        age |= ((*row(x, y, z >> 6, l) >> (z & 63)) & 1) << (l - 1);
+    return age ? age + 1 : state;
+}
+
+void
+Board::set (int x, int y, int z, int state)
+{
+    uint64_t bit = 1ULL << (z & 63);
+    /* the age of a dying cell, state 1 for living is age 0 */
+    int age = state > LIVE ? state - 1 : 0;
+
+    for (int l = 0; l < layers; l++) {
+        uint64_t *word = row(x, y, z >> 6, l);
+        if (l == 0 ? state == LIVE : (age >> (l - 1)) & 1)
+            *word |= bit;
+        else
+            *word &= ~bit;
+    }
+    if (state != DEAD)
+        chunk(x, y, z >> 6) = 1;
+}
+
+void
+Board::clear ()
+{
+    memset(words, 0, nwords * sizeof(uint64_t));
+    std::fill(chunks.begin(), chunks.end(), 0);
+}
+
+void
+Board::clear_chunks ()
+{
+    for (int w = 0; w < zwords; w++) {
+        for (int cx = 0; cx < chunks_x; cx++) {
+            for (int cy = 0; cy < chunks_y; cy++) {
+                if (!chunk_at(cx, cy, w))
+                    continue;
+
+                int x1 = std::min(cx * CHUNK + CHUNK, size_x);
+                int y0 = cy * CHUNK;
+                int rows = std::min(y0 + CHUNK, size_y) - y0;
+                for (int l = 0; l < layers; l++)
+                    for (int x = cx * CHUNK; x < x1; x++)
+                        memset(row(x, y0, w, l), 0, rows * sizeof(uint64_t));
+            }
+        }
+    }
+    std::fill(chunks.begin(), chunks.end(), 0);
+}
+
+void
+Board::copy (const Board &other)
+{
+    memcpy(words, other.words, nwords * sizeof(uint64_t));
+    chunks = other.chunks;
+}
+
+void
+Board::copy_chunks (const Board &other)
+{
+    for (int w = 0; w < zwords; w++) {
+        for (int cx = 0; cx < chunks_x; cx++) {
+            for (int cy = 0; cy < chunks_y; cy++) {
+                if (!chunk_at(cx, cy, w) && !other.chunk_at(cx, cy, w))
+                    continue;
+
+                int x1 = std::min(cx * CHUNK + CHUNK, size_x);
+                int y0 = cy * CHUNK;
+                int rows = std::min(y0 + CHUNK, size_y) - y0;
+                for (int l = 0; l < layers; l++)
+                    for (int x = cx * CHUNK; x < x1; x++)
+                        memcpy(row(x, y0, w, l), other.row(x, y0, w, l),
+                               rows * sizeof(uint64_t));
+            }
+        }
+    }
+    chunks = other.chunks;
+}
+
+unsigned long
+Board::population () const
+{
+    unsigned long count = 0;
+    each_live([&](int, int, int) { count++; });
+    return count;
+}
+
+/*
+ * Along z the cells across the edge go in bit 63 of the halo word before the
+ * first word and in the bit past the last cell, which is bit 0 of the halo
+ * word after it when the last word is full.  The x and y halos are then
+ * copies of whole words, halo words included, so the edges and corners of
+ * the halo are across two or three edges at once.
+ */
+void
+Board::fill_halo (int boundary, bool along_x) const
+{
+    if (boundary == Rule::WALL)
+        return;
+
+    bool wrap = boundary == Rule::TORUS;
+    int last = zwords - 1;
+    int top = (size_z - 1) & 63;
+    uint64_t tail = (2ULL << top) - 1;
+
+    for (int x = 0; x < size_x; x++) {
+        for (int y = 0; y < size_y; y++) {
+            uint64_t first = *row(x, y, 0) & 1;
+            uint64_t end = (*row(x, y, last) >> top) & 1;
+
+            uint64_t after = wrap ? first : end;
+
+            *halo(x, y, -1) = (wrap ? end : first) << 63;
+            if (top == 63) {
+                *halo(x, y, zwords) = after;
+            }
+            else {
+                *halo(x, y, zwords) = 0;
+                *halo(x, y, last) =
+                    (*row(x, y, last) & tail) | after << (top + 1);
+            }
+        }
+    }
+
+    for (int w = -1; w <= zwords; w++) {
+        for (int y = 0; y < size_y && along_x; y++) {
+            *halo(-1, y, w) = *row(wrap ? size_x - 1 : 0, y, w);
+            *halo(size_x, y, w) = *row(wrap ? 0 : size_x - 1, y, w);
+        }
+        for (int x = along_x ? -1 : 0; x < size_x + along_x; x++) {
+            *halo(x, -1, w) = *row(x, wrap ? size_y - 1 : 0, w);
+            *halo(x, size_y, w) = *row(x, wrap ? 0 : size_y - 1, w);
+        }
+    }
+}
+
+void
+Board::clear_halo () const
+{
+    uint64_t tail = size_z % 64 ? (1ULL << (size_z % 64)) - 1 : ~0ULL;
+
+    memset(halo(-1, -1, -1), 0, plane * sizeof(uint64_t));
+    memset(halo(-1, -1, zwords), 0, plane * sizeof(uint64_t));
+    for (int w = 0; w < zwords; w++) {
+        memset(halo(-1, -1, w), 0, pad_y * sizeof(uint64_t));
+        memset(halo(size_x, -1, w), 0, pad_y * sizeof(uint64_t));
+        for (int x = 0; x < size_x; x++) {
+            *halo(x, -1, w) = 0;
+            *halo(x, size_y, w) = 0;
+        }
+    }
+    for (int x = 0; x < size_x; x++)
+        for (int y = 0; y < size_y; y++)
+            *halo(x, y, zwords - 1) &= tail;
+}
+
+/* the halo of a board filled for as long as it is in scope */
+struct FilledHalo {
+    const Board &board;
+    int boundary;
+
+    FilledHalo (const Board &board, int boundary)
+        : board(board)
+        , boundary(boundary)
+    {
+        board.fill_halo(boundary);
+    }
+
+    ~FilledHalo ()
+    {
+        if (boundary != Rule::WALL)
+            board.clear_halo();
+    }
+};
+
+int
+cell_neighbors (const Board &board, int x, int y, int z, int type)
+{
+    int neighbors = -(board.get(x, y, z) == type);
+
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+                neighbors += board.get(x + dx, y + dy, z + dz) == type;
+
+    return neighbors;
+}
+
+/*
+ * The dimensions and strides of a board as the kernel sees them.  With N > 0
+ * the board is an N^3 cube and every member is a constant the compiler can
+ * fold into the loops and neighbor offsets.  Only moves look at `boundary',
+ * counts read it from the halo.  A board which is a domain of a larger one
+ * starts at plane `origin' of `extent', which moves wrap and stop at.
+ */
+template <int N>
+struct Shape {
+    int x, y, z;
+    int zwords;
+    ptrdiff_t pad_y;
+    ptrdiff_t plane;
+    int boundary;
+    int origin, extent;
+
+    Shape (const Board &b, int boundary, int origin = 0, int extent = 0)
+        : x(N ? N : b.size_x)
+        , y(N ? N : b.size_y)
+        , z(N ? N : b.size_z)
+        , zwords(N ? (N + 63) / 64 : b.zwords)
+        , pad_y(N ? N + 2 : b.pad_y)
+        , plane(N ? (ptrdiff_t)(N + 2) * (N + 2) : (ptrdiff_t)b.plane)
+        , boundary(boundary)
+        , origin(origin)
+        , extent(extent ? extent : x)
+    { }
+
+    /* where position i along an axis of `size' cells lands past the edge */
+    int
+    across (int i, int size) const
+    {
+        if (i < 0)
+            return boundary == Rule::TORUS ? size - 1 : 0;
+        if (i >= size)
+            return boundary == Rule::TORUS ? 0 : size - 1;
+        return i;
+    }
+};
+
+/* rand() as a random stream for the serial steps */
+struct CRand {
+    int operator() () { return rand(); }
+};
+
+Rng::Rng (uint64_t seed)
+{
+    /* splitmix64 so nearby seeds give unrelated streams and never zero */
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    state = (seed ^ (seed >> 31)) | 1;
+}
+
+/*
+ * Move a cell which did not survive one step along a random axis.  If the
+ * cell it moves into is already taken it stays where it is.  The order of the
+ * calls to rand() is part of the rule, so both step functions share this.
+ * Against a wall a cell on the edge can't move along that axis and takes the
+ * next one; on a torus it wraps around and at a mirror it moves onto itself.
+ *
+ * Moves that leave the slab [x0, x1) are not made but added to `crossing'
+ * if given, as the slab next door may be writing to the target.
+ */
+template <int N, typename R>
+static inline void
+move_cell (const Shape<N> &dim, R &random, Board &next, int x, int y, int z,
+           int x0, int x1, std::vector<Move> *crossing)
+{
+    int axis;
+    int dir;
+    int ix, iy, iz;
+
+    dir = (random() % 2);
+    axis = random() % 100;
+
+    if (dir)
+        dir = -1;
+    else
+        dir = 1;
+
+    ix = x;
+    iy = y;
+    iz = z;
+
+    if (dim.boundary != Rule::WALL) {
+        if (axis < 33)
+            ix = dim.across(dim.origin + x + dir, dim.extent) - dim.origin;
+        else if (axis < 66)
+            iy = dim.across(y + dir, dim.y);
+        else
+            iz = dim.across(z + dir, dim.z);
+    }
+    else if (axis < 33 && dim.origin + x > 0 && dim.origin + x < dim.extent - 1)
+        ix += dir;
+    else if (axis < 66 && y > 0 && y < dim.y - 1)
+        iy += dir;
+    else if (z > 0 && z < dim.z - 1)
+        iz += dir;
+
+    if (crossing && (ix < x0 || ix >= x1)) {
+        Move m = { x, y, z, ix, iy, iz };
+        crossing->push_back(m);
+        return;
+    }
+
+    if (next.get(ix, iy, iz) == DEAD)
+        next.set(ix, iy, iz, LIVE);
+    else
+        next.set(x, y, z, LIVE);
+}
+
+void
+step_board_scalar (const Board &curr, Board &next, const Rule &rule)
+{
+    Shape<0> dim(curr, rule.boundary);
+    FilledHalo filled(curr, rule.boundary);
+    CRand random;
+
+    for (int x = 0; x < dim.x; x++) {
+        for (int y = 0; y < dim.y; y++) {
+            for (int z = 0; z < dim.z; z++) {
+                int state = curr.get(x, y, z);
+                if (rule.kind == Rule::WALK && state == DEAD)
+                    continue;
+
+                int n = cell_neighbors(curr, x, y, z, LIVE);
+                if (rule.kind == Rule::WALK) {
+                    if ((rule.survive >> n) & 1)
+                        next.set(x, y, z, LIVE);
+                    else
+                        move_cell(dim, random, next, x, y, z, 0, dim.x, NULL);
+                }
+                else if (state == LIVE) {
+                    if ((rule.survive >> n) & 1)
+                        next.set(x, y, z, LIVE);
+                    else if (rule.kind == Rule::GENERATIONS)
+                        next.set(x, y, z, LIVE + 1);
+                }
+                else if (state == DEAD) {
+                    if ((rule.birth >> n) & 1)
+                        next.set(x, y, z, LIVE);
+                }
+                else if (state + 1 < rule.states) {
+                    next.set(x, y, z, state + 1);
+                }
+            }
+        }
+    }
+}
+
+bool
+cast_ray (const Board &board, float ox, float oy, float oz,
+          float dx, float dy, float dz, Hit &hit)
+{
+    /* shifted by half a cell so that cell i is [i, i + 1) along each axis */
+    const float o[3] = { ox + 0.5f, oy + 0.5f, oz + 0.5f };
+    const float d[3] = { dx, dy, dz };
+    const int size[3] = { board.size_x, board.size_y, board.size_z };
+    float enter = 0, leave = INFINITY;
+    int axis = -1;
+
+    /* clip the ray to the board, noting the side it comes in by */
+    for (int a = 0; a < 3; a++) {
+        if (d[a] == 0) {
+            if (o[a] < 0 || o[a] >= size[a])
+                return false;
+            continue;
+        }
+        float t0 = -o[a] / d[a];
+        float t1 = (size[a] - o[a]) / d[a];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        if (t0 > enter) {
+            enter = t0;
+            axis = a;
+        }
+        leave = std::min(leave, t1);
+    }
+    if (enter > leave)
+        return false;
+
+    int cell[3];
+    int step[3];
+    int normal[3] = { 0, 0, 0 };
+    float next[3];
+    float delta[3];
+    for (int a = 0; a < 3; a++) {
+        float p = o[a] + d[a] * enter;
+        cell[a] = std::max(0, std::min((int) floorf(p), size[a] - 1));
+        step[a] = d[a] > 0 ? 1 : -1;
+        next[a] = d[a] == 0 ? INFINITY
+                : (cell[a] + (d[a] > 0) - o[a]) / d[a];
+        delta[a] = d[a] == 0 ? INFINITY : fabsf(1 / d[a]);
+    }
+    /* the face it came in by, or the one it faces when starting inside */
+    if (axis < 0) {
+        axis = fabsf(dx) > fabsf(dy) ? 0 : 1;
+        axis = fabsf(d[axis]) > fabsf(dz) ? axis : 2;
+    }
+    normal[axis] = -step[axis];
+
+    for (;;) {
+        if (board.get(cell[0], cell[1], cell[2]) == LIVE) {
+            hit.x = cell[0];
+            hit.y = cell[1];
+            hit.z = cell[2];
+            hit.nx = normal[0];
+            hit.ny = normal[1];
+            hit.nz = normal[2];
+            return true;
+        }
+
+        int a = next[0] < next[1] ? 0 : 1;
+        a = next[a] < next[2] ? a : 2;
+        cell[a] += step[a];
+        if (cell[a] < 0 || cell[a] >= size[a])
+            return false;
+        next[a] += delta[a];
+        normal[0] = normal[1] = normal[2] = 0;
+        normal[a] = -step[a];
+    }
+}
+
+template <typename T>
+static inline T
+load (const uint64_t *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+template <typename T>
+static inline void
+store (uint64_t *p, T v)
+{
+    memcpy(p, &v, sizeof(T));
+}
+
+static inline bool
+any (uint64_t v)
+{
+    return v != 0;
+}
+
+#ifdef BOARD_SIMD
+static inline bool
+any (lanes_t v)
+{
+    uint64_t r = 0;
+    for (int i = 0; i < LANES; i++)
+        r |= v[i];
+    return r != 0;
+}
+#endif
+
+/* full and half adders over every bit of a word at once */
+template <typename T>
+static inline void
+add3 (T a, T b, T c, T &sum, T &carry)
+{
+    T t = a ^ b;
+    sum = t ^ c;
+    carry = (a & b) | (t & c);
+}
+
+template <typename T>
+static inline void
+add2 (T a, T b, T &sum, T &carry)
+{
+    sum = a ^ b;
+    carry = a & b;
+}
+
+/*
+ * Count the 26 neighbors of the 64 cells in the word at `p' (or LANES words
+ * of consecutive rows along y) into a 5-bit number sliced across `count',
+ * count[0] being the least significant bit of every cell's count.
+ *
+ * Each of the 9 rows around the cell first sums its cells at z-1, z, z+1
+ * into a 2-bit number (the center row only has z-1 and z+1), then the 9
+ * ones and 9 twos are reduced with a tree of carry-save adders.
+ */
+template <typename T, int N>
+static inline void
+neighbor_count (const Shape<N> &dim, const uint64_t *p, T count[5])
+{
+    T s[9], k[9];
+    int n = 0;
+
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++, n++) {
+            const uint64_t *q = p + dx * dim.pad_y + dy;
+            T c = load<T>(q);
+            T lo = load<T>(q - dim.plane);
+            T hi = load<T>(q + dim.plane);
+            /* cells at z - 1 and z + 1, carrying across words */
+            T left = (c << 1) | (lo >> 63);
+            T right = (c >> 1) | (hi << 63);
+
+            if (dx == 0 && dy == 0)
+                add2(left, right, s[n], k[n]);
+            else
+                add3(left, c, right, s[n], k[n]);
+        }
+    }
+
+    T a1, a2, b1, b2, c1, c2, d2;
+    add3(s[0], s[1], s[2], a1, a2);
+    add3(s[3], s[4], s[5], b1, b2);
+    add3(s[6], s[7], s[8], c1, c2);
+    add3(a1, b1, c1, count[0], d2);
+
+    /* 13 twos: k[0..8], a2, b2, c2, d2 */
+    T e0, e1, e2, e3, g0, f0, f1, f2, f3, f4, f5;
+    add3(k[0], k[1], k[2], e0, f0);
+    add3(k[3], k[4], k[5], e1, f1);
+    add3(k[6], k[7], k[8], e2, f2);
+    add3(a2, b2, c2, e3, f3);
+    add3(e0, e1, e2, g0, f4);
+    add3(g0, e3, d2, count[1], f5);
+
+    /* 6 fours: f0..f5 */
+    T h0, h1, i0, i1, i2;
+    add3(f0, f1, f2, h0, i0);
+    add3(f3, f4, f5, h1, i1);
+    add2(h0, h1, count[2], i2);
+
+    /* 3 eights */
+    add3(i0, i1, i2, count[3], count[4]);
+}
+
+/*
+ * A set of neighbor counts is matched against a sliced count through its
+ * table of 32 bits, bit n telling whether n is in the set.  Each bit of the
+ * count selects half of what is left of the table, from the most
+ * significant bit down.  Counts past 26 never happen, so a set holding 26
+ * gets them as well, which turns sets like 19-26 into n >= 19.
+ */
+constexpr uint32_t
+count_table (uint32_t set)
+{
+    return (set >> MAX_NEIGHBORS) & 1
+        ? set | ~count_range(0, MAX_NEIGHBORS) : set;
+}
+
+template <typename T, uint32_t M, int B>
+struct Select {
+    static const int HALF = 1 << (B - 1);
+    static const uint32_t HI = M >> HALF;
+    static const uint32_t LO = M & ((1u << HALF) - 1);
+
+    static inline T
+    match (const T n[5])
+    {
+        return (n[B - 1] & Select<T, HI, B - 1>::match(n)) |
+               (~n[B - 1] & Select<T, LO, B - 1>::match(n));
+    }
+};
+
+template <typename T, uint32_t M>
+struct Select<T, M, 0> {
+    static inline T
+    match (const T *)
+    {
+        return T() | (M ? ~0ULL : 0ULL);
+    }
+};
+
+/*
+ * A set known at compile time.  The selects over its constant table fold
+ * away, leaving about as few operations as writing the test out by hand.
+ */
+template <uint32_t S>
+struct FixedSet {
+    template <typename T>
+    T
+    match (const T n[5]) const
+    {
+        return Select<T, count_table(S), 5>::match(n);
+    }
+};
+
+/*
+ * A set chosen at runtime, its table spread to a word per count so every
+ * select is the same 31 branch-free bitwise selects whatever the set.
+ */
+struct RuntimeSet {
+    uint64_t table[32];
+
+    RuntimeSet (uint32_t set)
+    {
+        uint32_t t = count_table(set);
+        for (int i = 0; i < 32; i++)
+            table[i] = (t >> i) & 1 ? ~0ULL : 0;
+    }
+
+    template <typename T>
+    T
+    match (const T n[5]) const
+    {
+        T v[16];
+        for (int i = 0; i < 16; i++)
+            v[i] = (n[0] & table[2 * i + 1]) | (~n[0] & table[2 * i]);
+        for (int b = 1, len = 8; b < 5; b++, len /= 2)
+            for (int i = 0; i < len; i++)
+                v[i] = (n[b] & v[2 * i + 1]) | (~n[b] & v[2 * i]);
+        return v[0];
+    }
+};
+
+/*
+ * The rules as the kernel sees them, each with its sets of counts fixed or
+ * chosen at runtime.  A step is dispatched once to a kernel for the rule,
+ * so a cell never waits on a virtual call or a test of the rule.
+ *
+ * Walk: living cells whose count is in the set survive in place, the rest
+ * move.  survivors() gives the cells of the word at `p' which stay.
+ */
+template <typename S>
+struct Walk {
+    S survive;
+
+    template <typename T, int N>
+    T
+    survivors (const Shape<N> &dim, const uint64_t *p) const
+    {
+        T live = load<T>(p);
+        if (!any(live))
+            return live;
+
+        T n[5];
+        neighbor_count<T>(dim, p, n);
+        return live & survive.match(n);
+    }
+};
+
+/*
+ * Life: evolve() writes the word at x, y, w of the next board, keeping only
+ * the cells in `valid', and returns whether it holds any cell.
+ */
+template <typename B, typename S>
+struct Life {
+    B birth;
+    S survive;
+
+    template <typename T, int N>
+    bool
+    evolve (const Shape<N> &dim, const Board &curr, Board &next,
+            int x, int y, int w, uint64_t valid) const
+    {
+        const uint64_t *p = curr.row(x, y, w);
+        T live = load<T>(p);
+        T n[5];
+        neighbor_count<T>(dim, p, n);
+
+        T out = (live & survive.match(n)) | (~live & birth.match(n));
+        out &= valid;
+        store(next.row(x, y, w), out);
+        return any(out);
+    }
+};
+
+/*
+ * Generations: as Life, but living cells which don't survive start dying
+ * and every dying cell ages by one each step until it reaches the last
+ * state.  Ages are added to a bit layer at a time with a ripple carry.
+ */
+template <typename B, typename S>
+struct Generations {
+    B birth;
+    S survive;
+    /* layers holding the age and the bits of the age at which cells die */
+    int ages;
+    uint64_t last[9];
+
+    Generations (const B &birth, const S &survive, const Rule &rule)
+        : birth(birth)
+        , survive(survive)
+        , ages(rule.layers() - 1)
+    {
+        for (int i = 0; i <= ages; i++)
+            last[i] = ((rule.states - 1) >> i) & 1 ? ~0ULL : 0;
+    }
+
+    template <typename T, int N>
+    bool
+    evolve (const Shape<N> &dim, const Board &curr, Board &next,
+            int x, int y, int w, uint64_t valid) const
+    {
+        const uint64_t *p = curr.row(x, y, w);
+        /* the bit past size_z may be filled from across the edge */
+        T live = load<T>(p) & valid;
+        T age[8];
+        T dying = T();
+        for (int i = 0; i < ages; i++) {
+            age[i] = load<T>(curr.row(x, y, w, i + 1));
+            dying |= age[i];
+        }
+
+        T n[5];
+        neighbor_count<T>(dim, p, n);
+        T stay = live & survive.match(n);
+        T out = stay | (~live & ~dying & birth.match(n) & valid);
+        T leaving = live & ~stay;
+
+        /* age the dying cells, those reaching the last state are dead */
+        T carry = dying;
+        T end = dying;
+        for (int i = 0; i < ages; i++) {
+            T a = age[i] ^ carry;
+            carry &= age[i];
+            age[i] = a;
+            end &= ~(a ^ last[i]);
+        }
+        end &= ~(carry ^ last[ages]);
+
+        T keep = dying & ~end;
+        T cells = out;
+        for (int i = 0; i < ages; i++) {
+            age[i] &= keep;
+            if (i == 0)
+                age[i] |= leaving;
+            store(next.row(x, y, w, i + 1), age[i]);
+            cells |= age[i];
+        }
+        store(next.row(x, y, w), out);
+        return any(cells);
+    }
+};
+
+/*
+ * The chunks a step visits: every flagged chunk of the board and the chunks
+ * around it, as cells move or are born at most one cell away.  `columns'
+ * flags each column of chunks along z which has any chunk to visit and
+ * `slabs' each chunk-wide slab of x-planes.  On a torus the chunks around
+ * one on an edge include those on the opposite edge.
+ */
+struct Active {
+    std::vector<uint8_t> chunks;
+    std::vector<uint8_t> columns;
+    std::vector<uint8_t> slabs;
+    bool wrap;
+
+    Active (const Board &board, int boundary)
+        : chunks((size_t)board.chunks_x * board.chunks_y * board.zwords, 0)
+        , columns((size_t)board.chunks_x * board.chunks_y, 0)
+        , slabs(board.chunks_x, 0)
+        , wrap(boundary == Rule::TORUS)
+    {
+        for (int w = 0; w < board.zwords; w++)
+            for (int cx = 0; cx < board.chunks_x; cx++)
+                for (int cy = 0; cy < board.chunks_y; cy++)
+                    if (board.chunk_at(cx, cy, w))
+                        mark_around(board, cx, cy, w);
+    }
+
+    void
+    mark_around (const Board &board, int cx, int cy, int w)
+    {
+        for (int di = -1; di <= 1; di++) {
+            int i = edge(w + di, board.zwords);
+            for (int dj = -1; dj <= 1; dj++) {
+                int j = edge(cx + dj, board.chunks_x);
+                for (int dk = -1; dk <= 1; dk++) {
+                    int k = edge(cy + dk, board.chunks_y);
+                    size_t c = ((size_t)i * board.chunks_x + j) *
+                               board.chunks_y + k;
+                    chunks[c] = 1;
+                    columns[(size_t)j * board.chunks_y + k] = 1;
+                    slabs[j] = 1;
+                }
+            }
+        }
+    }
+
+    /*
+     * Mark the chunks of the edge planes next to any living cell in the x
+     * planes of the halo, which hold the cells of other domains.
+     */
+    void
+    mark_halo (const Board &board)
+    {
+        for (int side = 0; side < 2; side++) {
+            int x = side ? board.size_x : -1;
+            for (int w = 0; w < board.zwords; w++) {
+                for (int y = 0; y < board.size_y; y++) {
+                    if (*board.row(x, y, w)) {
+                        mark_around(board, side ? board.chunks_x - 1 : 0,
+                                    y / CHUNK, w);
+                        y += CHUNK - 1 - (y % CHUNK);
+                    }
+                }
+            }
+        }
+    }
+
+    /* the chunk at i of `count' across the edge, or the one on it */
+    int
+    edge (int i, int count) const
+    {
+        if (i < 0)
+            return wrap ? count - 1 : 0;
+        if (i >= count)
+            return wrap ? 0 : count - 1;
+        return i;
+    }
+
+    bool
+    visit (const Board &board, int cx, int cy, int w) const
+    {
+        return chunks[((size_t)w * board.chunks_x + cx) * board.chunks_y + cy];
+    }
+
+    bool
+    visit (const Board &board, int cx, int cy) const
+    {
+        return columns[(size_t)cx * board.chunks_y + cy];
+    }
+
+    bool
+    visit (int cx) const
+    {
+        return slabs[cx];
+    }
+};
+
+/*
+ * Step the slab of x-planes [x0, x1) by a walk.  Survivors are found for a
+ * whole x-slice of the board at once, then the living cells of the slice
+ * are visited in x, y, z order, the same order as step_board_scalar, so
+ * that the cells which move draw the same numbers and claim their new
+ * positions in the same order.  Chunks which are not active are skipped
+ * entirely.
+ */
+template <int N, typename S, typename R>
+static void
+step_slab (const Shape<N> &dim, const Walk<S> &rule, const Active &active,
+           const Board &curr, Board &next,
+           int x0, int x1, R &random, std::vector<Move> *crossing)
+{
+    const uint64_t tail = dim.z % 64 ? (1ULL << (dim.z % 64)) - 1 : ~0ULL;
+    std::vector<uint64_t> slice(dim.zwords * dim.y);
+
+    for (int x = x0; x < x1; x++) {
+        int cx = x / CHUNK;
+
+        if (!active.visit(cx)) {
+            x += CHUNK - 1 - (x % CHUNK);
+            continue;
+        }
+
+        for (int cy = 0; cy < curr.chunks_y; cy++) {
+            if (!active.visit(curr, cx, cy))
+                continue;
+
+            int y0 = cy * CHUNK;
+            int y1 = std::min(y0 + CHUNK, dim.y);
+            for (int w = 0; w < dim.zwords; w++) {
+                if (!active.visit(curr, cx, cy, w))
+                    continue;
+
+                uint64_t *out = &slice[w * dim.y];
+                int y = y0;
+                for (; y + LANES <= y1; y += LANES) {
+                    store(out + y, rule.template survivors<lanes_t>(
+                                dim, curr.row(x, y, w)));
+                }
+                for (; y < y1; y++) {
+                    out[y] = rule.template survivors<uint64_t>(
+                                dim, curr.row(x, y, w));
+                }
+            }
+        }
+
+        for (int y = 0; y < dim.y; y++) {
+            if (!active.visit(curr, cx, y / CHUNK)) {
+                y += CHUNK - 1 - (y % CHUNK);
+                continue;
+            }
+
+            for (int w = 0; w < dim.zwords; w++) {
+                if (!curr.chunk(x, y, w))
+                    continue;
+
+                /* the bit past size_z may be filled from across the edge */
+                uint64_t live = *curr.row(x, y, w);
+                if (w == dim.zwords - 1)
+                    live &= tail;
+                uint64_t stay = slice[w * dim.y + y];
+
+                while (live) {
+                    int bit = __builtin_ctzll(live);
+                    live &= live - 1;
+
+                    if ((stay >> bit) & 1) {
+                        *next.row(x, y, w) |= 1ULL << bit;
+                        next.chunk(x, y, w) = 1;
+                    }
+                    else {
+                        move_cell(dim, random, next, x, y, w * 64 + bit,
+                                  x0, x1, crossing);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Step the slab of x-planes [x0, x1) by a rule whose cells don't move, a
+ * word of every active row at a time.  The rule writes every word it visits
+ * so nothing else of the next board is touched.
+ */
+template <int N, typename Rl, typename R>
+static void
+step_slab (const Shape<N> &dim, const Rl &rule, const Active &active,
+           const Board &curr, Board &next,
+           int x0, int x1, R &, std::vector<Move> *)
+{
+    const uint64_t tail = dim.z % 64 ? (1ULL << (dim.z % 64)) - 1 : ~0ULL;
+
+    for (int x = x0; x < x1; x++) {
+        int cx = x / CHUNK;
+
+        if (!active.visit(cx)) {
+            x += CHUNK - 1 - (x % CHUNK);
+            continue;
+        }
+
+        for (int cy = 0; cy < curr.chunks_y; cy++) {
+            if (!active.visit(curr, cx, cy))
+                continue;
+
+            int y0 = cy * CHUNK;
+            int y1 = std::min(y0 + CHUNK, dim.y);
+            for (int w = 0; w < dim.zwords; w++) {
+                if (!active.visit(curr, cx, cy, w))
+                    continue;
+
+                /* cells past size_z must stay dead, even when born */
+                uint64_t valid = w == dim.zwords - 1 ? tail : ~0ULL;
+                bool cells = false;
+                int y = y0;
+                for (; y + LANES <= y1; y += LANES) {
+                    cells |= rule.template evolve<lanes_t>(dim, curr, next,
+                                                           x, y, w, valid);
+                }
+                for (; y < y1; y++) {
+                    cells |= rule.template evolve<uint64_t>(dim, curr, next,
+                                                            x, y, w, valid);
+                }
+                if (cells)
+                    next.chunk(x, y0, w) = 1;
+            }
+        }
+    }
+}
+
+/*
+ * Call k.run<N>(rule) with the board's shape, instantiating the kernel for
+ * the common cube sizes.
+ */
+template <typename K, typename Rl>
+static void
+dispatch_size (const Board &board, const Rl &rule, K &k)
+{
+    if (board.size_x == board.size_y && board.size_y == board.size_z) {
+        switch (board.size_x) {
+            case 32:   k.template run<32>(rule); return;
+            case 64:   k.template run<64>(rule); return;
+            case 128:  k.template run<128>(rule); return;
+            case 256:  k.template run<256>(rule); return;
+            case 512:  k.template run<512>(rule); return;
+            case 1024: k.template run<1024>(rule); return;
+        }
+    }
+    k.template run<0>(rule);
+}
+
+/* the sets of counts of well known rules, compiled in */
+#define WALK_SURVIVE  count_range(19, MAX_NEIGHBORS)
+#define LIFE_4555_B   count_range(5, 5)
+#define LIFE_4555_S   count_range(4, 5)
+#define LIFE_5766_B   count_range(6, 6)
+#define LIFE_5766_S   count_range(5, 7)
+
+/*
+ * Call k.run<N>(rule) with the kernel's form of the rule: its sets fixed at
+ * compile time for the well known rules and chosen at runtime otherwise.
+ */
+template <typename K>
+static void
+dispatch (const Board &board, const Rule &rule, K &k)
+{
+    typedef FixedSet<WALK_SURVIVE> Walk19;
+    typedef FixedSet<LIFE_4555_B> Born4555;
+    typedef FixedSet<LIFE_4555_S> Survive4555;
+    typedef FixedSet<LIFE_5766_B> Born5766;
+    typedef FixedSet<LIFE_5766_S> Survive5766;
+    RuntimeSet birth(rule.birth);
+    RuntimeSet survive(rule.survive);
+
+    switch (rule.kind) {
+    case Rule::WALK:
+        if (rule.survive == WALK_SURVIVE)
+            dispatch_size(board, Walk<Walk19>(), k);
+        else
+            dispatch_size(board, Walk<RuntimeSet> { survive }, k);
+        break;
+
+    case Rule::LIFE:
+        if (rule.birth == LIFE_4555_B && rule.survive == LIFE_4555_S)
+            dispatch_size(board, Life<Born4555, Survive4555>(), k);
+        else if (rule.birth == LIFE_5766_B && rule.survive == LIFE_5766_S)
+            dispatch_size(board, Life<Born5766, Survive5766>(), k);
+        else
+            dispatch_size(board,
+                    Life<RuntimeSet, RuntimeSet> { birth, survive }, k);
+        break;
+
+    case Rule::GENERATIONS:
+        dispatch_size(board,
+                Generations<RuntimeSet, RuntimeSet>(birth, survive, rule), k);
+        break;
+    }
+}
+
+struct SerialStep {
+    const Board &curr;
+    Board &next;
+    int boundary;
+
+    template <int N, typename Rl>
+    void
+    run (const Rl &rule)
+    {
+        Shape<N> dim(curr, boundary);
+        Active active(curr, boundary);
+        CRand random;
+        step_slab(dim, rule, active, curr, next, 0, dim.x, random,
+                  (std::vector<Move>*) NULL);
+    }
+};
+
+void
+step_board (const Board &curr, Board &next, const Rule &rule)
+{
+    ScopedTimer timer(PHASE_STEP);
+    FilledHalo filled(curr, rule.boundary);
+    SerialStep k = { curr, next, rule.boundary };
+    dispatch(curr, rule, k);
+}
+
+/*
+ * Each slab is a chunk wide and draws from its own stream seeded by the
+ * generation's seed and the slab's index, so the result does not depend on
+ * the number of threads or which thread steps which slab.  Slabs only write
+ * words and chunk flags within their own planes.  Moves across a slab's
+ * border are resolved after every slab is done, slab by slab in order, with
+ * the same rule as any other move: the first cell to claim a position gets
+ * it and a cell whose target is taken stays where it is.
+ */
+#define SLAB_WIDTH CHUNK
+
+struct ParallelStep {
+    const Board &curr;
+    Board &next;
+    ThreadPool &pool;
+    uint64_t seed;
+    int boundary;
+
+    template <int N, typename Rl>
+    void
+    run (const Rl &rule)
+    {
+        const Shape<N> dim(curr, boundary);
+        Active active(curr, boundary);
+        int slabs = (dim.x + SLAB_WIDTH - 1) / SLAB_WIDTH;
+        std::vector<std::vector<Move>> crossing(slabs);
+
+        pool.run(slabs, [&](int s) {
+            int x0 = s * SLAB_WIDTH;
+            int x1 = std::min(x0 + SLAB_WIDTH, dim.x);
+            Rng random(seed * 0x100000001B3ULL + s);
+            step_slab(dim, rule, active, curr, next, x0, x1, random,
+                      &crossing[s]);
+        });
+
+        for (int s = 0; s < slabs; s++) {
+            for (auto &m : crossing[s]) {
+                if (next.get(m.ix, m.iy, m.iz) == DEAD)
+                    next.set(m.ix, m.iy, m.iz, LIVE);
+                else
+                    next.set(m.x, m.y, m.z, LIVE);
+            }
+        }
+    }
+};
+
+void
+step_board (const Board &curr, Board &next, const Rule &rule,
+            ThreadPool &pool, uint64_t seed)
+{
+    ScopedTimer timer(PHASE_STEP);
+    FilledHalo filled(curr, rule.boundary);
+    ParallelStep k = { curr, next, pool, seed, rule.boundary };
+    dispatch(curr, rule, k);
+}
+
+/*
+ * As ParallelStep, with slabs cut at chunk boundaries within [x0, x1) and
+ * seeded by the plane they start at in the whole board.
+ */
+struct DomainStep {
+    const Board &curr;
+    Board &next;
+    ThreadPool &pool;
+    uint64_t seed;
+    int boundary;
+    int origin;
+    int extent;
+    int x0, x1;
+    std::vector<Move> &crossing;
+
+    template <int N, typename Rl>
+    void
+    run (const Rl &rule)
+    {
+        const Shape<N> dim(curr, boundary, origin, extent);
+        Active active(curr, boundary);
+        /* the halo may still be being filled while the interior steps */
+        if (x0 == 0 || x1 == dim.x)
+            active.mark_halo(curr);
+
+        int first = x0 / SLAB_WIDTH;
+        int slabs = (x1 + SLAB_WIDTH - 1) / SLAB_WIDTH - first;
+        std::vector<std::vector<Move>> moves(slabs);
+
+        pool.run(slabs, [&](int s) {
+            int a = std::max((first + s) * SLAB_WIDTH, x0);
+            int b = std::min((first + s + 1) * SLAB_WIDTH, x1);
+            Rng random(seed * 0x100000001B3ULL + origin + a);
+            step_slab(dim, rule, active, curr, next, a, b, random, &moves[s]);
+        });
+
+        for (auto &m : moves)
+            crossing.insert(crossing.end(), m.begin(), m.end());
+    }
+};
+
+void
+step_domain (const Board &curr, Board &next, const Rule &rule,
+             ThreadPool &pool, uint64_t seed, int origin, int extent,
+             int x0, int x1, std::vector<Move> &crossing)
+{
+    if (x0 >= x1)
+        return;
+
+    DomainStep k = { curr, next, pool, seed, rule.boundary, origin, extent,
+                     x0, x1, crossing };
+    dispatch(curr, rule, k);
+}
+
+History::History (int depth, int size_x, int size_y, int size_z,
+                  const Rule &rule)
+    : rule(rule)
+    , head(0)
+    , count(1)
+    , steps(0)
+{
+    /* the oldest board is written while the newest is read */
+    depth = std::max(depth, 2);
+    boards.reserve(depth);
+    for (int i = 0; i < depth; i++)
+        boards.push_back(Board(size_x, size_y, size_z, rule.layers()));
+}
+
+Board &
+History::current ()
+{
+    return boards[head];
+}
+
+const Board &
+History::past (int back) const
+{
+    return boards[(head - back + boards.size()) % boards.size()];
+}
+
+int
+History::available () const
+{
+    return count;
+}
+
+unsigned long
+History::generation () const
+{
+    return steps;
+}
+
+/* clear the oldest board to hold the next generation */
+Board &
+History::advance ()
+{
+    Board &next = boards[(head + 1) % boards.size()];
+    next.clear_chunks();
+    return next;
+}
+
+void
+History::step ()
+{
+    step_board(current(), advance(), rule);
+    head = (head + 1) % boards.size();
+    count = std::min(count + 1, (int) boards.size());
+    steps++;
+}
+
+void
+History::step (ThreadPool &pool, uint64_t seed)
+{
+    step_board(current(), advance(), rule, pool, seed);
+    head = (head + 1) % boards.size();
+    count = std::min(count + 1, (int) boards.size());
+    steps++;
+}
+
+void
+History::record (const Board &board)
+{
+    /* only the chunks flagged on either board differ, the rest are dead */
+    boards[(head + 1) % boards.size()].copy_chunks(board);
+    head = (head + 1) % boards.size();
+    count = std::min(count + 1, (int) boards.size());
+    steps++;
+}
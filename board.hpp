@@ -0,0 +1,343 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "pool.hpp"
+#include "rule.hpp"
+
+#define LIVE      1
+#define DEAD      0
+#define CHUNK     16
+
+/*
+ * A board of cells packed one bit per cell.  Each word holds 64 cells along
+ * the z axis and words are laid out plane by plane:
+ *
+ *     words[w][x][y]  (w = z / 64)
+ *
+ * so that rows which are neighbors along y are neighbors in memory and can be
+ * loaded into vector registers together.  The board is surrounded by a layer
+ * of words on every side (a `halo') so the neighbor kernel never has to check
+ * bounds.  The halo and the bits past size_z in the last word of a row are
+ * dead, except while a step has filled them for a torus or a mirror.
+ *
+ * The words are allocated at runtime and aligned to a cache line.
+ *
+ * The board is also split into chunks of CHUNK x CHUNK rows of one word
+ * each, with a flag per chunk that is set whenever a cell in it is set
+ * living.  Chunks without the flag hold no living cells, so stepping and
+ * scanning the board can skip them.  A flagged chunk may have since died.
+ *
+ * Rules with more states than living and dead give the board more `layers'
+ * of words laid out like the first.  The first layer always holds the
+ * living cells and the rest hold the age of dying cells as a binary number,
+ * a cell of age a having the state a + 1.  Chunk flags are set for dying
+ * cells as well.
+ */
+class Board {
+public:
+    Board (int size_x, int size_y, int size_z, int layers = 1);
+    Board (const Board &other);
+    ~Board ();
+
+    Board &operator= (Board other);
+    void swap (Board &other);
+
+    int get (int x, int y, int z) const;
+    void set (int x, int y, int z, int state);
+
+    /* kill every cell */
+    void clear ();
+
+    /* kill every cell by clearing only the flagged chunks */
+    void clear_chunks ();
+
+    /* copy the cells of another board of the same size and layers */
+    void copy (const Board &other);
+
+    /*
+     * The same, copying only the chunks flagged on either board, as every
+     * other chunk is dead on both already.
+     */
+    void copy_chunks (const Board &other);
+
+    /* number of living cells */
+    unsigned long population () const;
+
+    /*
+     * Fill the halo of the living cells, and the bit past size_z in the last
+     * word of each row, with what lies across the edge by `boundary' (a
+     * Rule::WALL, TORUS or MIRROR).  Counting neighbors then reads through
+     * the edges without a test.  The halo isn't part of the board's cells so
+     * it is filled on a board which is otherwise only read, and must be
+     * cleared before the board is read as a whole again.  Without `along_x'
+     * the halo planes at x = -1 and x = size_x are left to the caller.
+     */
+    void fill_halo (int boundary, bool along_x = true) const;
+    void clear_halo () const;
+
+    /* the flag of the chunk holding row x, y, w */
+    uint8_t &
+    chunk (int x, int y, int w)
+    {
+        size_t c = ((size_t)w * chunks_x + x / CHUNK) * chunks_y + y / CHUNK;
+        return chunks[c];
+    }
+
+    uint8_t
+    chunk (int x, int y, int w) const
+    {
+        size_t c = ((size_t)w * chunks_x + x / CHUNK) * chunks_y + y / CHUNK;
+        return chunks[c];
+    }
+
+    /* the flag of the chunk at chunk coordinates cx, cy, w */
+    uint8_t
+    chunk_at (int cx, int cy, int w) const
+    {
+        return chunks[((size_t)w * chunks_x + cx) * chunks_y + cy];
+    }
+
+    /* the word holding cells [w * 64, w * 64 + 64) of row x, y */
+    uint64_t *
+    row (int x, int y, int w)
+    {
+        return words + ((w + 1) * (size_t)pad_x + (x + 1)) * pad_y + (y + 1);
+    }
+
+    const uint64_t *
+    row (int x, int y, int w) const
+    {
+        return words + ((w + 1) * (size_t)pad_x + (x + 1)) * pad_y + (y + 1);
+    }
+
+    /* the same word of another layer */
+    uint64_t *
+    row (int x, int y, int w, int layer)
+    {
+        return row(x, y, w) + layer * layer_words;
+    }
+
+    const uint64_t *
+    row (int x, int y, int w, int layer) const
+    {
+        return row(x, y, w) + layer * layer_words;
+    }
+
+    /* call f(x, y, z) for every living cell, chunk by chunk */
+    template <typename F>
+    void
+    each_live (F f) const
+    {
+        for (int w = 0; w < zwords; w++) {
+            for (int cx = 0; cx < chunks_x; cx++) {
+                for (int cy = 0; cy < chunks_y; cy++) {
+                    if (!chunk_at(cx, cy, w))
+                        continue;
+
+                    int x1 = std::min(cx * CHUNK + CHUNK, size_x);
+                    int y1 = std::min(cy * CHUNK + CHUNK, size_y);
+                    for (int x = cx * CHUNK; x < x1; x++) {
+                        for (int y = cy * CHUNK; y < y1; y++) {
+                            uint64_t bits = *row(x, y, w);
+                            while (bits) {
+                                f(x, y, w * 64 + __builtin_ctzll(bits));
+                                bits &= bits - 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    int size_x;
+    int size_y;
+    int size_z;
+
+    /* words per row along z, not counting the halo */
+    int zwords;
+    /* padded dimensions of the word array */
+    int pad_x;
+    int pad_y;
+    int pad_w;
+    /* distance between the same row in neighboring planes */
+    size_t plane;
+    /* chunks along x and y, there are zwords along z */
+    int chunks_x;
+    int chunks_y;
+    /* layers of words and the words in each */
+    int layers;
+    size_t layer_words;
+
+protected:
+    /* a word of the halo, which may be written on a board only read */
+    uint64_t *
+    halo (int x, int y, int w) const
+    {
+        return words + (row(x, y, w) - words);
+    }
+
+    uint64_t *words;
+    size_t nwords;
+    std::vector<uint8_t> chunks;
+};
+
+/*
+ * Call f(x, y, z, state) for every cell which differs between two boards of
+ * the same size, with its state in `after'.  Only chunks flagged on either
+ * board are compared.
+ */
+template <typename F>
+void
+each_change (const Board &before, const Board &after, F f)
+{
+    for (int w = 0; w < before.zwords; w++) {
+        for (int cx = 0; cx < before.chunks_x; cx++) {
+            for (int cy = 0; cy < before.chunks_y; cy++) {
+                if (!before.chunk_at(cx, cy, w) && !after.chunk_at(cx, cy, w))
+                    continue;
+
+                int x1 = std::min(cx * CHUNK + CHUNK, before.size_x);
+                int y1 = std::min(cy * CHUNK + CHUNK, before.size_y);
+                for (int x = cx * CHUNK; x < x1; x++) {
+                    for (int y = cy * CHUNK; y < y1; y++) {
+                        uint64_t now = *after.row(x, y, w);
+                        uint64_t diff = *before.row(x, y, w) ^ now;
+                        while (diff) {
+                            int bit = __builtin_ctzll(diff);
+                            f(x, y, w * 64 + bit, (int) (now >> bit) & 1);
+                            diff &= diff - 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * A small random stream (xorshift64*) so that each part of a parallel step
+ * can draw its own numbers.  Like rand(), numbers are in [0, 2^31).
+ */
+struct Rng {
+    Rng (uint64_t seed);
+
+    int
+    operator() ()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (state * 0x2545F4914F6CDD1DULL) >> 33;
+    }
+
+    uint64_t state;
+};
+
+/*
+ * Count each neighbor either being dead or living, reading across the edges
+ * of the board into its halo: dead unless fill_halo has filled it.  This is
+ * the scalar version of the count that step_board does 64 cells at a time.
+ */
+int cell_neighbors (const Board &board, int x, int y, int z, int type);
+
+/*
+ * Step `curr' one generation into `next' by `rule'.  `next' must be cleared
+ * and the same size, with the layers the rule needs.  The halo of `curr' is
+ * filled for the rule's boundary before the step and cleared after it, so
+ * no part of the step tests for an edge but the moves.  Neighbors are counted
+ * with bit-sliced adders over whole words, several rows at once where the
+ * CPU has vector registers.  Common cube sizes and well known rules get
+ * their own instantiation of the kernel with constant strides and sets.
+ * Only chunks holding living cells, and the chunks around them, are visited.
+ */
+void step_board (const Board &curr, Board &next, const Rule &rule);
+
+/*
+ * Step `curr' into `next' with the board split into slabs of x-planes across
+ * the threads of `pool'.  Cells move using random streams derived from `seed'
+ * rather than rand(), so a given seed always gives the same generation.
+ * Each slab is a chunk of planes wide, so it only flags chunks of its own,
+ * which caps the threads kept busy at size_x / CHUNK: 2 on a 32-wide board,
+ * 4 on a 64-wide one, however many the pool has.
+ */
+void step_board (const Board &curr, Board &next, const Rule &rule,
+                 ThreadPool &pool, uint64_t seed);
+
+/* a cell moving from x, y, z to ix, iy, iz, out of the planes being stepped */
+struct Move {
+    int x, y, z;
+    int ix, iy, iz;
+};
+
+/*
+ * Step the x-planes [x0, x1) of a board which is one domain of a larger one:
+ * the planes [origin, origin + size_x) of a board `extent' planes wide.  The
+ * halo of `curr' is filled by the caller, its x planes coming from the
+ * domains on either side, so the planes which don't read them can be stepped
+ * while they are still on their way.  Moves out of [x0, x1) are not made but
+ * added to `crossing', in the domain's coordinates.
+ */
+void step_domain (const Board &curr, Board &next, const Rule &rule,
+                  ThreadPool &pool, uint64_t seed, int origin, int extent,
+                  int x0, int x1, std::vector<Move> &crossing);
+
+/* The same rules as step_board, a cell at a time using cell_neighbors. */
+void step_board_scalar (const Board &curr, Board &next, const Rule &rule);
+
+/* a cell hit by a ray and the normal of the face the ray entered it by */
+struct Hit {
+    int x, y, z;
+    int nx, ny, nz;
+};
+
+/*
+ * Cast a ray from origin o along direction d through the board, where a
+ * cell at x, y, z is the unit cube around that point, and find the first
+ * living cell it passes through.  Cells are walked one at a time along the
+ * ray (3D-DDA) from where it enters the board.  Returns false if the ray
+ * leaves the board without hitting a living cell.
+ */
+bool cast_ray (const Board &board, float ox, float oy, float oz,
+               float dx, float dy, float dz, Hit &hit);
+
+/*
+ * The last generations of a board kept in a ring of boards.  Stepping writes
+ * the new generation over the oldest board, clearing only the chunks it had
+ * flagged, and moves the head of the ring, so no generation is ever copied.
+ * Every generation still in the ring can be read back.
+ */
+class History {
+public:
+    History (int depth, int size_x, int size_y, int size_z, const Rule &rule);
+
+    /* the newest generation */
+    Board &current ();
+
+    /* the generation `back' steps before the newest, back < available() */
+    const Board &past (int back) const;
+
+    /* number of generations which can be read, the newest included */
+    int available () const;
+
+    /* number of generations stepped or recorded since the first */
+    unsigned long generation () const;
+
+    /* step the newest generation, with rand() or across a pool */
+    void step ();
+    void step (ThreadPool &pool, uint64_t seed);
+
+    /* make a copy of a board stepped elsewhere the newest generation */
+    void record (const Board &board);
+
+protected:
+    Board &advance ();
+
+    Rule rule;
+    std::vector<Board> boards;
+    int head;
+    int count;
+    unsigned long steps;
+};
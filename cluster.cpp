@@ -0,0 +1,704 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "cluster.hpp"
+
+#define CLUSTER_MAGIC   "MODELNET"
+#define CLUSTER_VERSION 1
+
+Link::Link (int fd)
+    : fd(fd)
+{
+    /* halos and moves are small and waited on, so never hold them back */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+Link::~Link ()
+{
+    close(fd);
+}
+
+Link *
+Link::connect_to (const char *address)
+{
+    std::string text(address);
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos) {
+        fprintf(stderr, "Not a host:port: %s\n", address);
+        exit(1);
+    }
+    std::string host = text.substr(0, colon);
+    std::string port = text.substr(colon + 1);
+
+    struct addrinfo hints;
+    struct addrinfo *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+        fprintf(stderr, "Could not find %s\n", address);
+        exit(1);
+    }
+
+    for (int i = 0; i < CONNECT_TRIES; i++) {
+        if (i > 0)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        for (struct addrinfo *a = found; a; a = a->ai_next) {
+            int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                freeaddrinfo(found);
+                return new Link(fd);
+            }
+            close(fd);
+        }
+    }
+    fprintf(stderr, "Could not connect to %s: %s\n", address, strerror(errno));
+    exit(1);
+}
+
+static void
+send_all (int fd, const void *data, size_t bytes)
+{
+    const uint8_t *p = (const uint8_t*) data;
+    while (bytes > 0) {
+        ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Lost a connection: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+static void
+receive_all (int fd, void *data, size_t bytes)
+{
+    uint8_t *p = (uint8_t*) data;
+    while (bytes > 0) {
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Lost a connection%s%s\n", n ? ": " : "",
+                    n ? strerror(errno) : "");
+            exit(1);
+        }
+        p += n;
+        bytes -= n;
+    }
+}
+
+void
+Link::send (uint32_t type, const void *data, size_t bytes)
+{
+    MessageHeader header = { type, 0, bytes };
+    send_all(fd, &header, sizeof(header));
+    send_all(fd, data, bytes);
+}
+
+uint32_t
+Link::receive (std::vector<uint8_t> &data)
+{
+    MessageHeader header;
+    receive_all(fd, &header, sizeof(header));
+    data.resize(header.bytes);
+    receive_all(fd, data.data(), header.bytes);
+    return header.type;
+}
+
+void
+Link::receive (uint32_t type, std::vector<uint8_t> &data)
+{
+    uint32_t got = receive(data);
+    if (got != type) {
+        fprintf(stderr, "Expected a message of type %u, not %u\n", type, got);
+        exit(1);
+    }
+}
+
+/*
+ * Each link moves through sending its header and payload and receiving its
+ * header and payload as far as the socket lets it, waiting in poll() on
+ * whatever is left.
+ */
+void
+exchange (Link *links[2], uint32_t type,
+          const std::vector<uint8_t> out[2], std::vector<uint8_t> in[2])
+{
+    MessageHeader sent[2];
+    MessageHeader got[2];
+    /* bytes of header and payload sent and received so far */
+    size_t sending[2] = { 0, 0 };
+    size_t receiving[2] = { 0, 0 };
+    const size_t head = sizeof(MessageHeader);
+
+    for (int i = 0; i < 2; i++) {
+        sent[i].type = type;
+        sent[i].reserved = 0;
+        sent[i].bytes = out[i].size();
+        in[i].clear();
+    }
+
+    for (;;) {
+        struct pollfd fds[2];
+        int waiting = 0;
+
+        for (int i = 0; i < 2; i++) {
+            fds[i].fd = -1;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (!links[i])
+                continue;
+            fds[i].fd = links[i]->fd;
+            if (sending[i] < head + out[i].size())
+                fds[i].events |= POLLOUT;
+            if (receiving[i] < head || receiving[i] < head + got[i].bytes)
+                fds[i].events |= POLLIN;
+            if (fds[i].events)
+                waiting++;
+        }
+        if (!waiting)
+            return;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Could not poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (int i = 0; i < 2; i++) {
+            bool receives = fds[i].events & POLLIN;
+            if (fds[i].revents & POLLOUT) {
+                const uint8_t *p;
+                size_t left;
+                if (sending[i] < head) {
+                    p = (const uint8_t*) &sent[i] + sending[i];
+                    left = head - sending[i];
+                }
+                else {
+                    p = out[i].data() + (sending[i] - head);
+                    left = head + out[i].size() - sending[i];
+                }
+                ssize_t n = ::send(fds[i].fd, p, left,
+                                   MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                    fprintf(stderr, "Lost a connection: %s\n", strerror(errno));
+                    exit(1);
+                }
+                if (n > 0)
+                    sending[i] += n;
+            }
+
+            if (receives && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                uint8_t *p;
+                size_t left;
+                if (receiving[i] < head) {
+                    p = (uint8_t*) &got[i] + receiving[i];
+                    left = head - receiving[i];
+                }
+                else {
+                    p = in[i].data() + (receiving[i] - head);
+                    left = head + got[i].bytes - receiving[i];
+                }
+                ssize_t n = recv(fds[i].fd, p, left, MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    fprintf(stderr, "Lost a connection%s%s\n", n ? ": " : "",
+                            n ? strerror(errno) : "");
+                    exit(1);
+                }
+                if (n > 0)
+                    receiving[i] += n;
+
+                if (receiving[i] == head && n > 0) {
+                    if (got[i].type != type) {
+                        fprintf(stderr, "Expected a message of type %u, "
+                                        "not %u\n", type, got[i].type);
+                        exit(1);
+                    }
+                    in[i].resize(got[i].bytes);
+                }
+            }
+        }
+    }
+}
+
+/* the words of plane x, of rows -1 to size_y and words -1 to zwords */
+static void
+pack_plane (const Board &board, int x, std::vector<uint8_t> &out)
+{
+    size_t row_bytes = board.pad_y * sizeof(uint64_t);
+    out.resize(board.pad_w * row_bytes);
+    for (int w = -1; w <= board.zwords; w++)
+        memcpy(&out[(w + 1) * row_bytes], board.row(x, -1, w), row_bytes);
+}
+
+static void
+unpack_plane (Board &board, int x, const std::vector<uint8_t> &in)
+{
+    size_t row_bytes = board.pad_y * sizeof(uint64_t);
+    if (in.size() != board.pad_w * row_bytes) {
+        fprintf(stderr, "A halo of %zu bytes, not %zu\n", in.size(),
+                board.pad_w * row_bytes);
+        exit(1);
+    }
+    for (int w = -1; w <= board.zwords; w++)
+        memcpy(board.row(x, -1, w), &in[(w + 1) * row_bytes], row_bytes);
+}
+
+/* the words of planes [x0, x1) of a board, as MSG_CELLS sends them */
+static void
+pack_cells (const Board &board, int x0, int x1, std::vector<uint8_t> &out)
+{
+    size_t row_bytes = board.size_y * sizeof(uint64_t);
+    out.clear();
+    for (int l = 0; l < board.layers; l++) {
+        for (int w = 0; w < board.zwords; w++) {
+            for (int x = x0; x < x1; x++) {
+                const uint8_t *p = (const uint8_t*) board.row(x, 0, w, l);
+                out.insert(out.end(), p, p + row_bytes);
+            }
+        }
+    }
+}
+
+static void
+unpack_cells (Board &board, const std::vector<uint8_t> &in)
+{
+    size_t row_bytes = board.size_y * sizeof(uint64_t);
+    const uint8_t *p = in.data();
+    if (in.size() != board.layers * board.zwords * board.size_x * row_bytes) {
+        fprintf(stderr, "A domain of %zu bytes doesn't fit the board\n",
+                in.size());
+        exit(1);
+    }
+    for (int l = 0; l < board.layers; l++) {
+        for (int w = 0; w < board.zwords; w++) {
+            for (int x = 0; x < board.size_x; x++, p += row_bytes) {
+                memcpy(board.row(x, 0, w, l), p, row_bytes);
+                for (int y = 0; y < board.size_y; y++)
+                    if (board.row(x, 0, w, l)[y])
+                        board.chunk(x, y, w) = 1;
+            }
+        }
+    }
+}
+
+/*
+ * A worker's part of a board being stepped: its domain, the links to the
+ * domains on either side and to the coordinator.
+ */
+class Domain {
+public:
+    Domain (const DomainSetup &setup, const Rule &rule, Link *coordinator,
+            Link *left, Link *right, ThreadPool &pool);
+
+    void run ();
+
+protected:
+    void step (uint64_t seed);
+    void fill_x_halo ();
+    void settle (std::vector<Move> &crossing);
+
+    DomainSetup setup;
+    Rule rule;
+    Link *coordinator;
+    /* the domains on the left and right, NULL at an edge of the board */
+    Link *links[2];
+    ThreadPool &pool;
+    Board curr;
+    Board next;
+};
+
+Domain::Domain (const DomainSetup &setup, const Rule &rule,
+                Link *coordinator, Link *left, Link *right, ThreadPool &pool)
+    : setup(setup)
+    , rule(rule)
+    , coordinator(coordinator)
+    , pool(pool)
+    , curr(setup.width, setup.size_y, setup.size_z, rule.layers())
+    , next(setup.width, setup.size_y, setup.size_z, rule.layers())
+{
+    std::vector<uint8_t> cells;
+
+    links[0] = left;
+    links[1] = right;
+    coordinator->receive(MSG_CELLS, cells);
+    unpack_cells(curr, cells);
+}
+
+void
+Domain::run ()
+{
+    for (uint64_t g = 0; g < setup.generations; g++) {
+        /* the same seed for a generation as stepping with a pool */
+        step(setup.seed + g);
+        curr.swap(next);
+        next.clear_chunks();
+
+        ReportMessage report = { g + 1, curr.population() };
+        coordinator->send(MSG_REPORT, &report, sizeof(report));
+    }
+}
+
+/*
+ * Fill the halo planes on the sides without a domain, where the board has
+ * an edge, or where a torus of a single domain meets itself.
+ */
+void
+Domain::fill_x_halo ()
+{
+    int last = curr.size_x - 1;
+    std::vector<uint8_t> plane;
+
+    for (int side = 0; side < 2; side++) {
+        if (links[side] || rule.boundary == Rule::WALL)
+            continue;
+        if (rule.boundary == Rule::TORUS)
+            pack_plane(curr, side ? 0 : last, plane);
+        else
+            pack_plane(curr, side ? last : 0, plane);
+        unpack_plane(curr, side ? curr.size_x : -1, plane);
+    }
+}
+
+/*
+ * Step a generation.  The planes on the edges go to the domains on either
+ * side on a thread of their own while the interior planes are stepped, and
+ * those on the edges are stepped once the halo has come back.
+ */
+void
+Domain::step (uint64_t seed)
+{
+    int width = curr.size_x;
+    std::vector<uint8_t> out[2];
+    std::vector<uint8_t> in[2];
+    std::vector<Move> crossing;
+
+    curr.fill_halo(rule.boundary, false);
+    pack_plane(curr, 0, out[0]);
+    pack_plane(curr, width - 1, out[1]);
+    fill_x_halo();
+
+    std::thread sending([&]() {
+        exchange(links, MSG_HALO, out, in);
+        for (int side = 0; side < 2; side++)
+            if (links[side])
+                unpack_plane(curr, side ? width : -1, in[side]);
+    });
+    step_domain(curr, next, rule, pool, seed, setup.origin, setup.size_x,
+                1, width - 1, crossing);
+    sending.join();
+
+    step_domain(curr, next, rule, pool, seed, setup.origin, setup.size_x,
+                0, 1, crossing);
+    step_domain(curr, next, rule, pool, seed, setup.origin, setup.size_x,
+                width - 1, width, crossing);
+    curr.clear_halo();
+
+    if (rule.kind == Rule::WALK)
+        settle(crossing);
+}
+
+/*
+ * Make the moves out of the planes they were stepped in: those within the
+ * domain first, in the order they were drawn, then those from the domain on
+ * the left and the one on the right.  Moves to another domain are made
+ * there, and the cells of those it didn't claim stay where they were.
+ */
+void
+Domain::settle (std::vector<Move> &crossing)
+{
+    int width = curr.size_x;
+    int extent = setup.size_x;
+    /* the plane of the whole board just left of this domain */
+    int before = (setup.origin + extent - 1) % extent;
+    std::vector<Move> leaving[2];
+    std::vector<uint8_t> out[2];
+    std::vector<uint8_t> in[2];
+
+    for (auto &m : crossing) {
+        if (m.ix >= 0 && m.ix < width) {
+            if (next.get(m.ix, m.iy, m.iz) == DEAD)
+                next.set(m.ix, m.iy, m.iz, LIVE);
+            else
+                next.set(m.x, m.y, m.z, LIVE);
+            continue;
+        }
+
+        Move global = m;
+        global.x += setup.origin;
+        global.ix += setup.origin;
+        int side = global.ix == before ? 0 : 1;
+        if (!links[side]) {
+            next.set(m.x, m.y, m.z, LIVE);
+            continue;
+        }
+        leaving[side].push_back(global);
+    }
+
+    for (int side = 0; side < 2; side++) {
+        const uint8_t *p = (const uint8_t*) leaving[side].data();
+        out[side].assign(p, p + leaving[side].size() * sizeof(Move));
+    }
+    exchange(links, MSG_MOVES, out, in);
+
+    for (int side = 0; side < 2; side++) {
+        size_t count = in[side].size() / sizeof(Move);
+        const Move *moves = (const Move*) in[side].data();
+        out[side].assign(count, 0);
+        for (size_t i = 0; i < count; i++) {
+            int ix = moves[i].ix - setup.origin;
+            if (ix < 0 || ix >= width) {
+                fprintf(stderr, "A move to plane %d, outside of this domain\n",
+                        moves[i].ix);
+                exit(1);
+            }
+            if (next.get(ix, moves[i].iy, moves[i].iz) == DEAD) {
+                next.set(ix, moves[i].iy, moves[i].iz, LIVE);
+                out[side][i] = 1;
+            }
+        }
+    }
+    exchange(links, MSG_CLAIMS, out, in);
+
+    for (int side = 0; side < 2; side++) {
+        if (!links[side])
+            continue;
+        if (in[side].size() != leaving[side].size()) {
+            fprintf(stderr, "%zu claims of %zu moves\n", in[side].size(),
+                    leaving[side].size());
+            exit(1);
+        }
+        for (size_t i = 0; i < leaving[side].size(); i++) {
+            const Move &m = leaving[side][i];
+            if (!in[side][i])
+                next.set(m.x - setup.origin, m.y, m.z, LIVE);
+        }
+    }
+}
+
+/* listen on every address, IPv4 ones included, of IPv6 if there is any */
+static int
+listen_on (int port)
+{
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1;
+    int zero = 0;
+    struct sockaddr_in6 address6;
+    struct sockaddr_in address4;
+    struct sockaddr *address = (struct sockaddr*) &address6;
+    socklen_t length = sizeof(address6);
+
+    memset(&address6, 0, sizeof(address6));
+    address6.sin6_family = AF_INET6;
+    address6.sin6_addr = in6addr_any;
+    address6.sin6_port = htons(port);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    }
+    else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&address4, 0, sizeof(address4));
+        address4.sin_family = AF_INET;
+        address4.sin_addr.s_addr = htonl(INADDR_ANY);
+        address4.sin_port = htons(port);
+        address = (struct sockaddr*) &address4;
+        length = sizeof(address4);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open a socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, address, length) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", port,
+                strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * Take connections until there is a coordinator and, if the setup says so,
+ * the worker on the left.  Either may come first, since the worker on the
+ * left connects once its own setup has arrived.
+ */
+static void
+serve (int listener, ThreadPool &pool)
+{
+    Link *coordinator = NULL;
+    Link *left = NULL;
+    Link *right = NULL;
+    DomainSetup setup;
+    Rule rule;
+    std::vector<uint8_t> data;
+
+    memset(&setup, 0, sizeof(setup));
+    while (!coordinator || (setup.left && !left)) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Could not accept: %s\n", strerror(errno));
+            exit(1);
+        }
+        Link *link = new Link(fd);
+        uint32_t type = link->receive(data);
+
+        if (type == MSG_SETUP && !coordinator &&
+            data.size() == sizeof(setup)) {
+            memcpy(&setup, data.data(), sizeof(setup));
+            setup.rule[sizeof(setup.rule) - 1] = 0;
+            setup.right[sizeof(setup.right) - 1] = 0;
+            if (memcmp(setup.magic, CLUSTER_MAGIC, 8) != 0 ||
+                setup.version != CLUSTER_VERSION ||
+                !parse_rule(setup.rule, rule) ||
+                setup.width < DOMAIN_PLANES) {
+                fprintf(stderr, "Not a setup this worker can step\n");
+                delete link;
+                continue;
+            }
+            coordinator = link;
+            if (setup.right[0]) {
+                right = Link::connect_to(setup.right);
+                right->send(MSG_HELLO, &setup.index, sizeof(setup.index));
+            }
+        }
+        else if (type == MSG_HELLO && !left) {
+            left = link;
+        }
+        else {
+            fprintf(stderr, "Dropped a connection sending message %u\n", type);
+            delete link;
+        }
+    }
+
+    fprintf(stderr, "Stepping planes %d to %d of %dx%dx%d by %s, "
+                    "domain %d of %d\n",
+                    setup.origin, setup.origin + setup.width - 1,
+                    setup.size_x, setup.size_y, setup.size_z, setup.rule,
+                    setup.index + 1, setup.domains);
+    {
+        Domain domain(setup, rule, coordinator, left, right, pool);
+        domain.run();
+    }
+
+    delete coordinator;
+    delete left;
+    delete right;
+}
+
+void
+run_worker (int port, ThreadPool &pool)
+{
+    int listener = listen_on(port);
+
+    for (;;)
+        serve(listener, pool);
+}
+
+void
+run_cluster (const Board &board, const Rule &rule, uint64_t seed,
+             unsigned long generations,
+             const std::vector<std::string> &workers)
+{
+    typedef std::chrono::steady_clock clock;
+    int domains = workers.size();
+    std::vector<Link*> links;
+    std::vector<uint8_t> data;
+    double cells = (double) board.size_x * board.size_y * board.size_z;
+    std::string text = format_rule(rule);
+
+    if (domains * DOMAIN_PLANES > board.size_x) {
+        fprintf(stderr, "%d workers can't share %d planes, each needs %d\n",
+                domains, board.size_x, DOMAIN_PLANES);
+        exit(1);
+    }
+
+    printf("%d %lu\n", 0, board.population());
+    clock::time_point start = clock::now();
+
+    /*
+     * Every setup is sent before any cells, as a worker waits on the one on
+     * its left to connect before reading its cells.
+     */
+    for (int i = 0, origin = 0; i < domains; i++) {
+        DomainSetup setup;
+        int width = board.size_x / domains + (i < board.size_x % domains);
+        bool wraps = rule.boundary == Rule::TORUS && domains > 1;
+
+        memset(&setup, 0, sizeof(setup));
+        memcpy(setup.magic, CLUSTER_MAGIC, 8);
+        setup.version = CLUSTER_VERSION;
+        setup.size_x = board.size_x;
+        setup.size_y = board.size_y;
+        setup.size_z = board.size_z;
+        setup.origin = origin;
+        setup.width = width;
+        setup.index = i;
+        setup.domains = domains;
+        setup.left = i > 0 || wraps;
+        setup.seed = seed;
+        setup.generations = generations;
+        snprintf(setup.rule, sizeof(setup.rule), "%s", text.c_str());
+        if (i < domains - 1 || wraps)
+            snprintf(setup.right, sizeof(setup.right), "%s",
+                     workers[(i + 1) % domains].c_str());
+
+        links.push_back(Link::connect_to(workers[i].c_str()));
+        links[i]->send(MSG_SETUP, &setup, sizeof(setup));
+        origin += width;
+    }
+    for (int i = 0, origin = 0; i < domains; i++) {
+        int width = board.size_x / domains + (i < board.size_x % domains);
+        pack_cells(board, origin, origin + width, data);
+        links[i]->send(MSG_CELLS, data.data(), data.size());
+        origin += width;
+    }
+
+    for (unsigned long g = 1; g <= generations; g++) {
+        uint64_t population = 0;
+        for (int i = 0; i < domains; i++) {
+            links[i]->receive(MSG_REPORT, data);
+            ReportMessage report;
+            memcpy(&report, data.data(), std::min(data.size(), sizeof(report)));
+            if (data.size() != sizeof(report) || report.generation != g) {
+                fprintf(stderr, "Worker %s is out of step\n",
+                        workers[i].c_str());
+                exit(1);
+            }
+            population += report.population;
+        }
+        printf("%lu %lu\n", g, (unsigned long) population);
+    }
+
+    double elapsed = std::chrono::duration<double>(
+            clock::now() - start).count();
+    fprintf(stderr, "%lu generations of %.0f cells in %.3f s on %d workers\n"
+                    "%.2f generations/s\n"
+                    "%.4g cells/s\n",
+                    generations, cells, elapsed, domains,
+                    generations / elapsed,
+                    cells * generations / elapsed);
+
+    for (Link *link : links)
+        delete link;
+}
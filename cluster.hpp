@@ -0,0 +1,124 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "board.hpp"
+#include "pool.hpp"
+#include "rule.hpp"
+
+/* tries a second apart at reaching a worker which isn't listening yet */
+#define CONNECT_TRIES 10
+/*
+ * the fewest planes a domain has: one on each edge, waiting on the halo, and
+ * at least one between them to step while the halo is on its way
+ */
+#define DOMAIN_PLANES 3
+
+/*
+ * A board stepped across processes, each holding a domain of it: a slab of
+ * whole x-planes.  Workers (model -W port) wait for a coordinator (model -H
+ * generations -N host:port,...) which splits the board among them, sends
+ * each its planes and then only collects the population of every generation.
+ *
+ * Every generation a worker sends the planes on its edges to the domains on
+ * either side, which put them in the x planes of their halo, and steps the
+ * planes which don't read the halo while they are on their way.  Cells of
+ * the walk rule which move out of a domain are sent to the domain they move
+ * into, which claims each target if it is free and answers with the moves
+ * it didn't claim, whose cells stay where they were.
+ *
+ * Workers connect to the domain on their right themselves, so a coordinator
+ * only ever talks to each worker and the addresses it is given must reach
+ * the workers from each other as well.  A Life rule steps to the same board
+ * as one process; moves differ, being drawn per domain.
+ *
+ * Each message is a MessageHeader and `bytes' of payload.  Numbers are sent
+ * in the byte order of the machine, so every process must share it.
+ */
+enum {
+    MSG_SETUP = 1,
+    /* the words of a domain: layer by layer, plane by plane, row by row */
+    MSG_CELLS,
+    /* a worker connecting to the one on its right, with its index */
+    MSG_HELLO,
+    /* a plane on the edge, as its rows y = -1 to size_y for w = -1 to zwords */
+    MSG_HALO,
+    /* moves into the receiver's domain, in the whole board's coordinates */
+    MSG_MOVES,
+    /* a byte per move received, 1 where the move was made */
+    MSG_CLAIMS,
+    /* the generation just stepped and the domain's population */
+    MSG_REPORT
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t bytes;
+};
+
+struct DomainSetup {
+    char magic[8];
+    uint32_t version;
+    /* the whole board */
+    int32_t size_x;
+    int32_t size_y;
+    int32_t size_z;
+    /* the planes [origin, origin + width) are this domain */
+    int32_t origin;
+    int32_t width;
+    int32_t index;
+    int32_t domains;
+    /* whether a worker on the left connects to this one */
+    uint32_t left;
+    uint64_t seed;
+    uint64_t generations;
+    /* the rule as format_rule writes it */
+    char rule[64];
+    /* host:port of the worker on the right, empty if there is none */
+    char right[128];
+};
+
+struct ReportMessage {
+    uint64_t generation;
+    uint64_t population;
+};
+
+/* a connection to another process, closed when destroyed */
+class Link {
+public:
+    Link (int fd);
+    ~Link ();
+
+    /* connect to host:port, exiting if it can't be reached */
+    static Link *connect_to (const char *address);
+
+    void send (uint32_t type, const void *data, size_t bytes);
+    /* receive a message, exiting unless it is of `type' */
+    void receive (uint32_t type, std::vector<uint8_t> &data);
+    /* receive a message of any type */
+    uint32_t receive (std::vector<uint8_t> &data);
+
+    int fd;
+};
+
+/*
+ * Send `out[i]' to `links[i]' and receive a message of `type' from each into
+ * `in[i]', both links at once so neither side waits on the other's sends.
+ * Links which are NULL are skipped.
+ */
+void exchange (Link *links[2], uint32_t type,
+               const std::vector<uint8_t> out[2], std::vector<uint8_t> in[2]);
+
+/* serve coordinators on `port' one at a time, stepping with `pool' */
+void run_worker (int port, ThreadPool &pool);
+
+/*
+ * Step `board' by `rule' for some generations across the workers at
+ * `workers', printing the population of every generation as run_headless
+ * does.
+ */
+void run_cluster (const Board &board, const Rule &rule, uint64_t seed,
+                  unsigned long generations,
+                  const std::vector<std::string> &workers);
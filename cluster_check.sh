@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Step boards across three workers on this machine and check that the
+# population of every generation is the one stepping them in one process
+# gives.  Life and Generations rules step to the same board however the
+# board is split, walks don't, so only those are checked.
+#
+#     sh cluster_check.sh [model] [first port]
+
+MODEL=${1:-./model}
+PORT=${2:-7301}
+GENERATIONS=100
+RULES="B4/S3-6 B4/S3-6:T B4/S4-6/C5:M"
+
+out=$(mktemp -d) || exit 1
+workers=""
+addresses=""
+for i in 0 1 2; do
+    "$MODEL" -W $((PORT + i)) -t 2 2>"$out/worker$i" &
+    workers="$workers $!"
+    addresses="$addresses${addresses:+,}localhost:$((PORT + i))"
+done
+trap 'kill $workers 2>/dev/null; rm -rf "$out"' EXIT
+
+failed=0
+for rule in $RULES; do
+    "$MODEL" -s 48 -S 7 -R $rule -H $GENERATIONS >"$out/one" 2>/dev/null
+    "$MODEL" -s 48 -S 7 -R $rule -H $GENERATIONS -N "$addresses" \
+        >"$out/cluster" 2>/dev/null
+    if [ ! -s "$out/one" ] || ! cmp -s "$out/one" "$out/cluster"; then
+        echo "$rule: the workers stepped a different board"
+        diff "$out/one" "$out/cluster" | head -5
+        failed=1
+    else
+        echo "$rule: $GENERATIONS generations match"
+    fi
+done
+exit $failed
@@ -1,6 +1,13 @@
 #define GL_GLEXT_PROTOTYPES 1
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include "draw.hpp"
+#include "profile.hpp"
+
+/* uniform buffer binding point of the FrameBlock */
+#define FRAME_BINDING 0
 
 void
 checkGLError()
@@ -15,27 +22,39 @@ checkGLError()
 
 
 static const GLchar* vertex_source =
-    "#version 130\n"
+    "#version 140\n"
     "in vec3 vertex;\n"
     "in vec3 norm;\n"
+    "in vec3 offset;\n"
+    "in vec4 size;\n"
 	"out vec3 FragPos;\n"
 	"out vec3 Normal;\n"
-    "uniform mat4 model;\n"
-    "uniform mat4 view;\n"
-    "uniform mat4 projection;\n"
+    "out float Shade;\n"
+    "layout(std140) uniform Frame {\n"
+    "   mat4 projection;\n"
+    "   mat4 view;\n"
+    "   vec4 lightPos;\n"
+    "};\n"
     "void main()\n"
     "{\n"
-    "   FragPos = vec3(model * vec4(vertex, 1.0));\n"
+    "   /* each instance is a cube placed at its own offset and sized */\n"
+    "   FragPos = vertex * size.xyz + offset;\n"
     "   Normal = norm;\n"
-    "   gl_Position = projection * view * model * vec4(vertex.xyz, 1.0);\n"
+    "   Shade = size.w;\n"
+    "   gl_Position = projection * view * vec4(FragPos, 1.0);\n"
     "}";
 
 static const GLchar* fragment_source =
-    "#version 130\n"
+    "#version 140\n"
     "out vec4 FragColor;\n"
     "in vec3 Normal;\n"
     "in vec3 FragPos;\n"
-    "uniform vec3 lightPos;\n"
+    "in float Shade;\n"
+    "layout(std140) uniform Frame {\n"
+    "   mat4 projection;\n"
+    "   mat4 view;\n"
+    "   vec4 lightPos;\n"
+    "};\n"
     "uniform vec3 lightColor;\n"
     "uniform vec3 objectColor;\n"
     "void main()\n"
@@ -46,14 +65,47 @@ static const GLchar* fragment_source =
     "\n"
     "   /* diffuse */\n"
     "   vec3 norm = normalize(Normal);\n"
-    "   vec3 lightDir = normalize(lightPos - FragPos);\n"
+    "   vec3 lightDir = normalize(lightPos.xyz - FragPos);\n"
     "   float diff = max(dot(norm, lightDir), 0.0);\n"
     "   vec3 diffuse = diff * lightColor;\n"
     "\n"
-    "   vec3 result = (ambient + diffuse) * objectColor;\n"
+    "   /* boxes of few cells are darker, whole cells aren't */\n"
+    "   vec3 result = (ambient + diffuse) * objectColor * (0.3 + 0.7 * Shade);\n"
     "   FragColor = vec4(result, 1.0);\n"
     "}";
 
+static const GLchar* overlay_vertex_source =
+    "#version 140\n"
+    "in vec2 corner;\n"
+    "in vec3 color;\n"
+    "out vec3 Color;\n"
+    "void main()\n"
+    "{\n"
+    "   Color = color;\n"
+    "   gl_Position = vec4(corner, 0.0, 1.0);\n"
+    "}";
+
+static const GLchar* overlay_fragment_source =
+    "#version 140\n"
+    "in vec3 Color;\n"
+    "out vec4 FragColor;\n"
+    "void main()\n"
+    "{\n"
+    "   FragColor = vec4(Color, 1.0);\n"
+    "}";
+
+/* the colors of the bars of the stats, taken in turn */
+static const float bar_colors[][3] = {
+    { 0.9f, 0.9f, 0.9f },
+    { 0.4f, 0.6f, 1.0f },
+    { 0.3f, 0.9f, 0.4f },
+    { 1.0f, 0.9f, 0.3f },
+    { 1.0f, 0.5f, 0.2f },
+    { 0.7f, 0.4f, 1.0f },
+    { 1.0f, 0.3f, 0.3f },
+    { 0.3f, 0.9f, 0.9f }
+};
+
 static const float vertices[] = {
     /* (x,y,z) and fragment shader (x,y,z) */
 
@@ -130,8 +182,56 @@ Shader::Shader (const char *vert_source, const char *frag_source)
             exit(1);
         }
     }
+
+    reflect();
+}
+
+/*
+ * Look up the location of every active uniform and attribute once so that
+ * using them never needs a lookup by string in OpenGL.
+ */
+void
+Shader::reflect ()
+{
+    GLint count, maxlength, size, length;
+    GLenum type;
+
+    glGetProgramiv(shader_prog, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(shader_prog, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxlength);
+    std::vector<char> name(maxlength + 1);
+
+    for (int i = 0; i < count; i++) {
+        glGetActiveUniform(shader_prog, i, maxlength, &length, &size, &type,
+                &name[0]);
+        Uniform u;
+        u.location = glGetUniformLocation(shader_prog, &name[0]);
+        u.set = false;
+        /* uniforms inside of blocks have no location */
+        if (u.location < 0)
+            continue;
+        /* arrays are reported as `name[0]' */
+        std::string key(&name[0], length);
+        if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+            key.resize(key.size() - 3);
+        uniform_names[key] = uniforms.size();
+        uniforms.push_back(u);
+    }
+
+    glGetProgramiv(shader_prog, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(shader_prog, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxlength);
+    name.resize(maxlength + 1);
+
+    for (int i = 0; i < count; i++) {
+        glGetActiveAttrib(shader_prog, i, maxlength, &length, &size, &type,
+                &name[0]);
+        attributes[std::string(&name[0], length)] =
+            glGetAttribLocation(shader_prog, &name[0]);
+    }
 }
 
+/* the program in use, so that using it again makes no call */
+static GLuint current_prog = 0;
+
 void
 Shader::use ()
 {
@@ -139,7 +239,10 @@ Shader::use ()
         fprintf(stderr, "Shader not initialized or may have been destroyed.\n");
         exit(1);
     }
+    if (current_prog == this->shader_prog)
+        return;
     glUseProgram(this->shader_prog);
+    current_prog = this->shader_prog;
 }
 
 void
@@ -148,6 +251,8 @@ Shader::destroy ()
     glDeleteShader(this->vert_shader);
     glDeleteShader(this->frag_shader);
     glDeleteProgram(this->shader_prog);
+    if (current_prog == this->shader_prog)
+        current_prog = 0;
     this->vert_shader = 0;
     this->frag_shader = 0;
     this->shader_prog = 0;
@@ -156,26 +261,82 @@ Shader::destroy ()
 GLuint
 Shader::get_attrib_loc (const char *name)
 {
-    return glGetAttribLocation(shader_prog, name);
+    std::map<std::string, GLint>::iterator it = attributes.find(name);
+    if (it == attributes.end())
+        return -1;
+    return it->second;
+}
+
+int
+Shader::uniform (const char *name)
+{
+    std::map<std::string, int>::iterator it = uniform_names.find(name);
+    if (it == uniform_names.end())
+        return -1;
+    return it->second;
+}
+
+void
+Shader::bind_block (const char *name, GLuint binding)
+{
+    GLuint index = glGetUniformBlockIndex(shader_prog, name);
+    if (index != GL_INVALID_INDEX)
+        glUniformBlockBinding(shader_prog, index, binding);
+}
+
+/* remember the value of a uniform, true if it was already that value */
+bool
+Shader::unchanged (int uniform, const float *value, int count)
+{
+    Uniform &u = uniforms[uniform];
+    if (u.set && memcmp(u.value, value, count * sizeof(float)) == 0)
+        return true;
+    memcpy(u.value, value, count * sizeof(float));
+    u.set = true;
+    return false;
+}
+
+void
+Shader::set_uniform_3f (int uniform, float x, float y, float z)
+{
+    float value[3] = { x, y, z };
+    if (uniform < 0 || unchanged(uniform, value, 3))
+        return;
+    glUniform3f(uniforms[uniform].location, x, y, z);
+}
+
+void
+Shader::set_uniform_3fv (int uniform, glm::vec3 vec)
+{
+    if (uniform < 0 || unchanged(uniform, &vec[0], 3))
+        return;
+    glUniform3fv(uniforms[uniform].location, 1, &vec[0]);
+}
+
+void
+Shader::set_uniform_mat4fv (int uniform, glm::mat4 matrix)
+{
+    if (uniform < 0 || unchanged(uniform, &matrix[0][0], 16))
+        return;
+    glUniformMatrix4fv(uniforms[uniform].location, 1, GL_FALSE, &matrix[0][0]);
 }
 
 void
 Shader::set_uniform_3f (const char *name, float x, float y, float z)
 {
-    glUniform3f(glGetUniformLocation(this->shader_prog, name), x, y, z);
+    set_uniform_3f(uniform(name), x, y, z);
 }
 
 void
 Shader::set_uniform_3fv (const char *name, glm::vec3 vec)
 {
-    glUniform3fv(glGetUniformLocation(this->shader_prog, name), 1, &vec[0]);
+    set_uniform_3fv(uniform(name), vec);
 }
 
 void
 Shader::set_uniform_mat4fv (const char *name, glm::mat4 matrix)
 {
-    glUniformMatrix4fv(glGetUniformLocation(this->shader_prog, name),
-            1, GL_FALSE, &matrix[0][0]);
+    set_uniform_mat4fv(uniform(name), matrix);
 }
 
 GLuint
@@ -401,6 +562,12 @@ Camera::projection ()
             (float)screen_x / (float)screen_y, 0.1f, 1000.0f);
 }
 
+float
+Camera::pixel_scale ()
+{
+    return screen_y / (2 * tanf(glm::radians(fov) / 2));
+}
+
 void
 Camera::set_mode (CameraMode mode)
 {
@@ -426,18 +593,192 @@ Camera::lookat (glm::vec3 pos, float zoom)
     fps_look(0,0);
 }
 
+StreamBuffer::StreamBuffer ()
+    : id(0)
+    , persistent(false)
+    , region_size(0)
+    , region(0)
+    , used(0)
+    , base(NULL)
+    , ptr(NULL)
+    , writing(false)
+    , mapped(false)
+{
+    for (int i = 0; i < STREAM_REGIONS; i++)
+        fences[i] = 0;
+}
+
+void
+StreamBuffer::create ()
+{
+    persistent = SDL_GL_ExtensionSupported("GL_ARB_buffer_storage");
+    allocate(STREAM_SIZE);
+}
+
+void
+StreamBuffer::destroy ()
+{
+    for (int i = 0; i < STREAM_REGIONS; i++)
+        if (fences[i])
+            glDeleteSync(fences[i]);
+    glDeleteBuffers(1, &id);
+}
+
+/*
+ * Make a buffer of STREAM_REGIONS regions of `size'.  Buffers are only
+ * ever bound to the copy targets here, so the array buffer bound for
+ * drawing is left alone.
+ */
+void
+StreamBuffer::allocate (size_t size)
+{
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                       GL_MAP_COHERENT_BIT;
+    size_t total = size * STREAM_REGIONS;
+
+    region_size = size;
+    region = 0;
+    glGenBuffers(1, &id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    if (persistent) {
+        glBufferStorage(GL_COPY_WRITE_BUFFER, total, NULL, flags);
+        base = (uint8_t *) glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total,
+                                            flags);
+        if (!base) {
+            fprintf(stderr, "Could not map a stream buffer\n");
+            exit(1);
+        }
+    }
+    else {
+        glBufferData(GL_COPY_WRITE_BUFFER, total, NULL, GL_STREAM_DRAW);
+    }
+}
+
+/*
+ * Start writing this frame's region, once the GPU is done with what was
+ * drawn from it STREAM_REGIONS frames ago.  Without persistent mapping
+ * only the part of the region after what was written already is mapped,
+ * and discarded.
+ */
+void
+StreamBuffer::map ()
+{
+    if (fences[region]) {
+        glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT,
+                         GL_TIMEOUT_IGNORED);
+        glDeleteSync(fences[region]);
+        fences[region] = 0;
+    }
+
+    if (persistent) {
+        ptr = base + offset();
+    }
+    else {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+        ptr = (uint8_t *) glMapBufferRange(GL_COPY_WRITE_BUFFER,
+                offset() + used, region_size - used,
+                GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                GL_MAP_INVALIDATE_RANGE_BIT);
+        if (!ptr) {
+            fprintf(stderr, "Could not map a stream buffer\n");
+            exit(1);
+        }
+        ptr -= used;
+        mapped = true;
+    }
+    writing = true;
+}
+
+/* make room for `bytes' more, moving to larger regions if they don't fit */
+void
+StreamBuffer::reserve (size_t bytes)
+{
+    if (!writing || (!persistent && !mapped))
+        map();
+    if (used + bytes <= region_size)
+        return;
+
+    size_t size = region_size;
+    while (size < used + bytes)
+        size *= 2;
+
+    /*
+     * The old buffer's regions will never be written again, so their
+     * fences are dropped and deleting it is left to the driver once the
+     * GPU is done with it.
+     */
+    GLuint old = id;
+    size_t from = offset();
+    unmap();
+    for (int i = 0; i < STREAM_REGIONS; i++) {
+        if (fences[i])
+            glDeleteSync(fences[i]);
+        fences[i] = 0;
+    }
+    allocate(size);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, old);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    if (used > 0)
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            from, 0, used);
+    glDeleteBuffers(1, &old);
+    map();
+}
+
+GLuint
+StreamBuffer::buffer () const
+{
+    return id;
+}
+
+size_t
+StreamBuffer::offset () const
+{
+    return region * region_size;
+}
+
+size_t
+StreamBuffer::size () const
+{
+    return used;
+}
+
+void
+StreamBuffer::unmap ()
+{
+    if (!mapped)
+        return;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    mapped = false;
+}
+
+void
+StreamBuffer::fence ()
+{
+    if (!writing)
+        return;
+    unmap();
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    region = (region + 1) % STREAM_REGIONS;
+    used = 0;
+    writing = false;
+}
+
 Window::Window ()
     : should_quit(false)
     , delta_time(0.0f)
     , last_frame(0.0f)
+    , show_placeholder(false)
+    , mouse_x(0)
+    , mouse_y(0)
+    , gpu_query(0)
 {
     SDL_DisplayMode display;
-    GLuint vertex_id, norm_id;
     display.w = 1920;
     display.h = 1080;
 
-    object_positions.reserve(50);
-
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "SDL Failed to init: %s\n", SDL_GetError());
         exit(1);
@@ -478,6 +819,20 @@ Window::Window ()
     this->shader = Shader(vertex_source, fragment_source);
     this->shader.use();
 
+    /* colors never change, so are set once */
+    this->shader.set_uniform_3f("objectColor", 1.0f, 0.5f, 0.31f);
+    this->shader.set_uniform_3f("lightColor", 1.0f, 0.5f, 0.31f);
+
+    /* camera and light are shared through the frame's uniform buffer */
+    this->shader.bind_block("Frame", FRAME_BINDING);
+    glGenBuffers(1, &frame_UBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_UBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, frame_UBO);
+    frame.projection = glm::mat4(0.0f);
+    frame.view = glm::mat4(0.0f);
+    frame.light_pos = glm::vec4(0.0f);
+
     /* Setup the buffer and attribute buffers so we can set values */
     glBindVertexArray(VAO);
 
@@ -497,6 +852,63 @@ Window::Window ()
                 GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
     glEnableVertexAttribArray(norm_id);
 
+    /*
+     * setup the offset attribute from the instance buffer, width of 3 and
+     * advanced once per cube instead of once per vertex.  Where in the
+     * stream it is read from is set every frame.
+     */
+    cubes.create();
+    glBindBuffer(GL_ARRAY_BUFFER, cubes.buffer());
+    this->offset_id = this->shader.get_attrib_loc("offset");
+    glVertexAttribPointer(offset_id, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), 0);
+    glVertexAttribDivisor(offset_id, 1);
+    glEnableVertexAttribArray(offset_id);
+
+    /* cells and meshes are all a unit cube wide and wholly shaded */
+    size_id = this->shader.get_attrib_loc("size");
+    glVertexAttrib4f(size_id, 1.0f, 1.0f, 1.0f, 1.0f);
+
+    /*
+     * Boxes are the same cube with both their offset and size advanced per
+     * instance, from a buffer of their own.
+     */
+    glGenVertexArrays(1, &box_VAO);
+    boxes.create();
+    glBindVertexArray(box_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glVertexAttribPointer(vertex_id, 3,
+                GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+    glEnableVertexAttribArray(vertex_id);
+    glVertexAttribPointer(norm_id, 3, GL_FLOAT,
+                GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(norm_id);
+    glBindBuffer(GL_ARRAY_BUFFER, boxes.buffer());
+    glVertexAttribPointer(offset_id, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(float), 0);
+    glVertexAttribDivisor(offset_id, 1);
+    glEnableVertexAttribArray(offset_id);
+    glVertexAttribPointer(size_id, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(float),
+                (void*)(3 * sizeof(float)));
+    glVertexAttribDivisor(size_id, 1);
+    glEnableVertexAttribArray(size_id);
+    glBindVertexArray(VAO);
+
+    /* the stats' bars, two floats of corner and three of color a vertex */
+    this->overlay = Shader(overlay_vertex_source, overlay_fragment_source);
+    glGenVertexArrays(1, &overlay_VAO);
+    glGenBuffers(1, &overlay_VBO);
+    glBindVertexArray(overlay_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, overlay_VBO);
+    GLuint corner_id = overlay.get_attrib_loc("corner");
+    glVertexAttribPointer(corner_id, 2, GL_FLOAT, GL_FALSE,
+                5 * sizeof(float), 0);
+    glEnableVertexAttribArray(corner_id);
+    GLuint color_id = overlay.get_attrib_loc("color");
+    glVertexAttribPointer(color_id, 3, GL_FLOAT, GL_FALSE,
+                5 * sizeof(float), (void*)(2 * sizeof(float)));
+    glEnableVertexAttribArray(color_id);
+    glBindVertexArray(VAO);
+    this->shader.use();
+
     if (SDL_GL_SetSwapInterval(1) < 0)
         fprintf(stderr, "Warning: SwapInterval could not be set: %s\n", 
                 SDL_GetError());
@@ -504,12 +916,28 @@ Window::Window ()
     glEnable(GL_CULL_FACE);
     /* Clockwise winding order are 'face' vertices */
     glFrontFace(GL_CW);
+
+    glGenQueries(GPU_QUERIES, gpu_queries);
+    for (int i = 0; i < GPU_QUERIES; i++)
+        gpu_pending[i] = false;
 }
 
 Window::~Window()
 {
     this->shader.destroy();
+    this->overlay.destroy();
 	glDeleteBuffers(1, &this->VBO);
+    glDeleteBuffers(1, &overlay_VBO);
+    glDeleteVertexArrays(1, &overlay_VAO);
+    cubes.destroy();
+    boxes.destroy();
+	glDeleteVertexArrays(1, &this->box_VAO);
+	glDeleteBuffers(1, &this->frame_UBO);
+    glDeleteQueries(GPU_QUERIES, gpu_queries);
+    for (auto &mesh : chunk_meshes) {
+        glDeleteBuffers(1, &mesh.VBO);
+        glDeleteVertexArrays(1, &mesh.VAO);
+    }
 	glDeleteBuffers(1, &this->VAO);
     SDL_GL_DeleteContext(this->glContext);
     SDL_DestroyWindow(this->window);
@@ -528,10 +956,80 @@ Window::lookat (float x, float y, float z, float zoom)
     camera.lookat(glm::vec3(x, y, z), zoom);
 }
 
+glm::mat4
+Window::view_projection ()
+{
+    return camera.projection() * camera.view();
+}
+
 void
 Window::draw_cube (float x, float y, float z)
 {
-    object_positions.push_back(glm::vec3(x, y, z));
+    float *cube = (float *) cubes.append(3 * sizeof(float));
+    cube[0] = x;
+    cube[1] = y;
+    cube[2] = z;
+}
+
+void
+Window::draw_box (glm::vec3 min, glm::vec3 max, float occupancy)
+{
+    glm::vec3 center = (min + max) * 0.5f;
+    glm::vec3 size = max - min;
+    float *box = (float *) boxes.append(7 * sizeof(float));
+    box[0] = center.x;
+    box[1] = center.y;
+    box[2] = center.z;
+    box[3] = size.x;
+    box[4] = size.y;
+    box[5] = size.z;
+    box[6] = occupancy;
+}
+
+glm::vec3
+Window::eye ()
+{
+    return camera.pos();
+}
+
+float
+Window::pixel_scale ()
+{
+    return camera.pixel_scale();
+}
+
+void
+Window::set_chunk_mesh (int id, const std::vector<float> &vertices)
+{
+    if (id >= (int) chunk_meshes.size()) {
+        ChunkMesh empty = { 0, 0, 0 };
+        chunk_meshes.resize(id + 1, empty);
+    }
+
+    ChunkMesh &mesh = chunk_meshes[id];
+    mesh.count = vertices.size() / 6;
+
+    if (mesh.VAO == 0) {
+        if (mesh.count == 0)
+            return;
+
+        /* same attributes as the cube, without the instance offset */
+        glGenVertexArrays(1, &mesh.VAO);
+        glGenBuffers(1, &mesh.VBO);
+        glBindVertexArray(mesh.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+        glVertexAttribPointer(vertex_id, 3,
+                    GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
+        glEnableVertexAttribArray(vertex_id);
+        glVertexAttribPointer(norm_id, 3, GL_FLOAT,
+                    GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(norm_id);
+        glBindVertexArray(VAO);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float),
+            vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
 }
 
 unsigned long
@@ -540,17 +1038,24 @@ Window::get_ticks ()
     return SDL_GetTicks();
 }
 
-glm::vec3
-get_coords_from_click (float x, float y,
-                       int width, int height,
-                       glm::mat4 view,
-                       glm::mat4 proj)
+void
+Window::mouse_ray (glm::vec3 &origin, glm::vec3 &dir)
 {
-    float depth;
-    glReadPixels(x, y, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
-    glm::vec4 window(0.f, 0.f, width, height);
-    glm::vec3 mouse(x, height - 1.f - y, depth);
-    return glm::round(glm::unProject(mouse, view, proj, window));
+    glm::mat4 view = camera.view();
+    glm::mat4 proj = camera.projection();
+    glm::vec4 window(0.f, 0.f, camera.screen_x, camera.screen_y);
+    float x = mouse_x;
+    float y = camera.screen_y - 1.f - mouse_y;
+
+    origin = glm::unProject(glm::vec3(x, y, 0.f), view, proj, window);
+    dir = glm::unProject(glm::vec3(x, y, 1.f), view, proj, window) - origin;
+}
+
+void
+Window::set_placeholder (bool shown, float x, float y, float z)
+{
+    show_placeholder = shown;
+    placeholder = glm::vec3(x, y, z);
 }
 
 void
@@ -566,18 +1071,24 @@ Window::handle_input ()
     /* time is in miliseconds, dividing by one-thousandth gets delta as float */
     delta = ((float)this->delta_time * 0.001);
 
+    pressed.clear();
+    clicks.clear();
+
     while (SDL_PollEvent(&e)) {
         switch (e.type) {
         case SDL_QUIT:
             should_quit = true;
             break;
 
+        case SDL_KEYDOWN:
+            pressed.push_back(e.key.keysym.scancode);
+            break;
+
         case SDL_MOUSEBUTTONDOWN:
-            if (e.button.button == SDL_BUTTON_LEFT) {
-                /* place object */
-            }
-            if (e.button.button == SDL_BUTTON_RIGHT) {
-                /* remove object */
+            /* left places an object and right removes one */
+            if (e.button.button == SDL_BUTTON_LEFT ||
+                    e.button.button == SDL_BUTTON_RIGHT) {
+                clicks.push_back(e.button.button);
             }
             break;
 
@@ -586,10 +1097,8 @@ Window::handle_input ()
             break;
 
         case SDL_MOUSEMOTION:
-            placeholder = get_coords_from_click(e.button.x, e.button.y,
-                                            camera.screen_x, camera.screen_y,
-                                            camera.view(),
-                                            camera.projection());
+            mouse_x = e.motion.x;
+            mouse_y = e.motion.y;
             if (e.button.button == SDL_BUTTON(SDL_BUTTON_RIGHT)) {
                 camera.look(e.motion.xrel, e.motion.yrel);
             }
@@ -625,34 +1134,181 @@ Window::handle_input ()
     }
 }
 
+bool
+Window::next_key (SDL_Scancode &key)
+{
+    if (pressed.empty())
+        return false;
+    key = pressed.front();
+    pressed.erase(pressed.begin());
+    return true;
+}
+
+bool
+Window::next_click (int &button)
+{
+    if (clicks.empty())
+        return false;
+    button = clicks.front();
+    clicks.erase(clicks.begin());
+    return true;
+}
+
+void
+Window::draw_stats (const std::vector<double> &ms)
+{
+    /* pixels from the top left corner to clip space */
+    float sx = 2.0f / camera.screen_x, sy = 2.0f / camera.screen_y;
+    float scale = STATS_WIDTH * 60 / 1000.0f;
+
+    auto rect = [&](float x0, float y0, float x1, float y1,
+                    const float *color) {
+        const float corners[6][2] = {
+            { x0, y0 }, { x1, y0 }, { x1, y1 },
+            { x1, y1 }, { x0, y1 }, { x0, y0 }
+        };
+        for (int i = 0; i < 6; i++) {
+            bars.push_back(-1 + corners[i][0] * sx);
+            bars.push_back(1 - corners[i][1] * sy);
+            bars.insert(bars.end(), color, color + 3);
+        }
+    };
+
+    /* bars half their height apart, a bar's height in from the corner */
+    float left = STATS_HEIGHT, top = STATS_HEIGHT, bottom = top;
+    int colors = sizeof(bar_colors) / sizeof(bar_colors[0]);
+    for (size_t i = 0; i < ms.size(); i++) {
+        /* a bar can run to twice the budget before it is cut off */
+        float length = std::min((float)ms[i] * scale, 2.0f * STATS_WIDTH);
+        float y = top + 1.5f * STATS_HEIGHT * i;
+        rect(left, y, left + length, y + STATS_HEIGHT, bar_colors[i % colors]);
+        bottom = y + STATS_HEIGHT;
+    }
+    rect(left + STATS_WIDTH, top, left + STATS_WIDTH + 2, bottom,
+         bar_colors[0]);
+}
+
 void
 Window::render ()
 {
-    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    this->shader.set_uniform_3f("objectColor", 1.0f, 0.5f, 0.31f);
-    this->shader.set_uniform_3f("lightColor", 1.0f, 0.5f, 0.31f);
+    /* take the GPU time of earlier frames whose queries have finished */
+    for (int i = 0; i < GPU_QUERIES; i++) {
+        GLint done = 0;
+        GLuint64 elapsed;
+        if (!gpu_pending[i])
+            continue;
+        glGetQueryObjectiv(gpu_queries[i], GL_QUERY_RESULT_AVAILABLE, &done);
+        if (!done)
+            continue;
+        glGetQueryObjectui64v(gpu_queries[i], GL_QUERY_RESULT, &elapsed);
+        profiler.add(PHASE_GPU, gpu_started[i], elapsed);
+        gpu_pending[i] = false;
+    }
 
-    this->shader.set_uniform_mat4fv("projection", this->camera.projection());
-    this->shader.set_uniform_3fv("lightPos", this->camera.pos());
-    this->shader.set_uniform_mat4fv("view", this->camera.view());
+    /* only upload the frame's camera and light when they have moved */
+    {
+        ScopedTimer timer(PHASE_UNIFORMS);
+        FrameBlock next;
+        next.projection = this->camera.projection();
+        next.view = this->camera.view();
+        next.light_pos = glm::vec4(this->camera.pos(), 1.0f);
+        if (memcmp(&next, &frame, sizeof(FrameBlock)) != 0) {
+            frame = next;
+            glBindBuffer(GL_UNIFORM_BUFFER, frame_UBO);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &frame);
+        }
+    }
 
-    for (auto &loc : object_positions) {
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, loc);
-        //model = glm::rotate(model, (float)(SDL_GetTicks() * 0.001), glm::vec3(0, 0, 1));
-        this->shader.set_uniform_mat4fv("model", model);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+    /* a frame goes untimed on the GPU while every query is still in flight */
+    bool timing = !gpu_pending[gpu_query];
+    if (timing) {
+        gpu_started[gpu_query] = profiler.now();
+        glBeginQuery(GL_TIME_ELAPSED, gpu_queries[gpu_query]);
     }
-    object_positions.clear();
 
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glm::mat4 model = glm::mat4(1.0f);
-    model = glm::translate(model, placeholder);
-    this->shader.set_uniform_mat4fv("model", model);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    {
+        ScopedTimer timer(PHASE_DRAW);
+        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        /*
+         * Draw all of the cubes with one call, straight from where
+         * draw_cube wrote them in the stream.
+         */
+        cubes.unmap();
+        if (cubes.size() > 0) {
+            glBindBuffer(GL_ARRAY_BUFFER, cubes.buffer());
+            glVertexAttribPointer(offset_id, 3, GL_FLOAT, GL_FALSE,
+                    3 * sizeof(float), (void *) cubes.offset());
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 36,
+                    cubes.size() / (3 * sizeof(float)));
+        }
+        cubes.fence();
+
+        /* the boxes standing in for distant cells, with one call as well */
+        boxes.unmap();
+        if (boxes.size() > 0) {
+            glBindVertexArray(box_VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, boxes.buffer());
+            glVertexAttribPointer(offset_id, 3, GL_FLOAT, GL_FALSE,
+                    7 * sizeof(float), (void *) boxes.offset());
+            glVertexAttribPointer(size_id, 4, GL_FLOAT, GL_FALSE,
+                    7 * sizeof(float),
+                    (void *) (boxes.offset() + 3 * sizeof(float)));
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 36,
+                    boxes.size() / (7 * sizeof(float)));
+            glBindVertexArray(VAO);
+            /* drawing size from an array leaves the constant undefined */
+            glVertexAttrib4f(size_id, 1.0f, 1.0f, 1.0f, 1.0f);
+        }
+        boxes.fence();
+
+        /* chunk meshes are already in place and have no offset */
+        glVertexAttrib3f(offset_id, 0.0f, 0.0f, 0.0f);
+        for (auto &mesh : chunk_meshes) {
+            if (mesh.count == 0)
+                continue;
+            glBindVertexArray(mesh.VAO);
+            glDrawArrays(GL_TRIANGLES, 0, mesh.count);
+        }
+        glBindVertexArray(VAO);
+
+        /* the placeholder is one cube at a constant offset */
+        if (show_placeholder) {
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            glDisableVertexAttribArray(offset_id);
+            glVertexAttrib3f(offset_id, placeholder.x, placeholder.y, placeholder.z);
+            glDrawArrays(GL_TRIANGLES, 0, 36);
+            glEnableVertexAttribArray(offset_id);
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        }
 
-    SDL_GL_SwapWindow(window);
+        /* the stats go over everything else, facing either way */
+        if (!bars.empty()) {
+            glDisable(GL_DEPTH_TEST);
+            glDisable(GL_CULL_FACE);
+            overlay.use();
+            glBindVertexArray(overlay_VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, overlay_VBO);
+            glBufferData(GL_ARRAY_BUFFER, bars.size() * sizeof(float),
+                         bars.data(), GL_STREAM_DRAW);
+            glDrawArrays(GL_TRIANGLES, 0, bars.size() / 5);
+            glBindVertexArray(VAO);
+            shader.use();
+            glEnable(GL_CULL_FACE);
+            glEnable(GL_DEPTH_TEST);
+            bars.clear();
+        }
+    }
+
+    if (timing) {
+        glEndQuery(GL_TIME_ELAPSED);
+        gpu_pending[gpu_query] = true;
+        gpu_query = (gpu_query + 1) % GPU_QUERIES;
+    }
+
+    {
+        ScopedTimer timer(PHASE_SWAP);
+        SDL_GL_SwapWindow(window);
+    }
 }
@@ -1,16 +1,31 @@
 #pragma once
-#define GLM_SWIZZLE
-#define GLM_ENABLE_EXPERIMENTAL
+#include <map>
+#include <string>
 #include <vector>
+#include <stdint.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <GL/gl.h>
 #include <GL/glext.h>
 #include <GL/glu.h>
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtx/euler_angles.hpp>
-#include <glm/gtc/type_ptr.hpp>
+#include "vecmath.hpp"
+
+/* frames of GPU timer queries in flight at once */
+#define GPU_QUERIES 4
+/* regions of a StreamBuffer, each written while the GPU reads the others */
+#define STREAM_REGIONS 3
+/* bytes a StreamBuffer's regions start with */
+#define STREAM_SIZE (1 << 20)
+/* pixels long a bar of the stats is for a frame at 60 Hz, and its height */
+#define STATS_WIDTH 400
+#define STATS_HEIGHT 12
+
+/* an active uniform of a shader and the last value it was set to */
+struct Uniform {
+    GLint location;
+    bool set;
+    float value[16];
+};
 
 class Shader {
 public:
@@ -19,16 +34,102 @@ public:
     void use ();
     void destroy ();
     GLuint get_attrib_loc (const char *name);
+
+    /* handle of a uniform found at link time, -1 if there is no such uniform */
+    int uniform (const char *name);
+
+    /* bind a uniform block to a uniform buffer binding point */
+    void bind_block (const char *name, GLuint binding);
+
+    /*
+     * Set a uniform by its handle.  Setting a uniform to the value it already
+     * has makes no call to OpenGL.  A handle of -1 is ignored.
+     */
+    void set_uniform_3f (int uniform, float x, float y, float z);
+    void set_uniform_3fv (int uniform, glm::vec3 vec);
+    void set_uniform_mat4fv (int uniform, glm::mat4 matrix);
+
+    /* the same, looking the handle up by name */
     void set_uniform_3f (const char *name, float x, float y, float z);
     void set_uniform_3fv (const char *name, glm::vec3 vec);
     void set_uniform_mat4fv (const char *name, glm::mat4 matrix);
 
 protected:
     GLuint compile_shader (const char *src, int type);
+    void reflect ();
+    bool unchanged (int uniform, const float *value, int count);
 
     GLuint vert_shader;
     GLuint frag_shader;
     GLuint shader_prog;
+
+    /* every active uniform and attribute, looked up once after linking */
+    std::vector<Uniform> uniforms;
+    std::map<std::string, int> uniform_names;
+    std::map<std::string, GLint> attributes;
+};
+
+/*
+ * A buffer refilled every frame by writing straight into GPU-visible memory,
+ * so uploads never respecify the buffer and never make the driver copy or
+ * wait.  It is split into STREAM_REGIONS regions used one frame each in
+ * turn.  Once the draws reading a region are issued it is fenced, and it is
+ * only written again after that fence has passed, which with three regions
+ * is long before the region comes around again.
+ *
+ * Where the driver has buffer storage the whole buffer is mapped once,
+ * persistent and coherent.  Elsewhere a frame's region is mapped
+ * unsynchronized when it is first written and unmapped before drawing.
+ * When a frame's data outgrows a region, it moves to a buffer with regions
+ * twice as large, the data written so far copied over on the GPU.
+ */
+class StreamBuffer {
+public:
+    StreamBuffer ();
+
+    /* make the buffer, which needs a context */
+    void create ();
+    void destroy ();
+
+    /* room for `bytes' more of this frame's data, to be written at once */
+    void *
+    append (size_t bytes)
+    {
+        if (!writing || used + bytes > region_size)
+            reserve(bytes);
+        void *at = ptr + used;
+        used += bytes;
+        return at;
+    }
+
+    /* the buffer, where this frame's data starts in it and its bytes */
+    GLuint buffer () const;
+    size_t offset () const;
+    size_t size () const;
+
+    /* let the draws about to be issued read this frame's data */
+    void unmap ();
+
+    /* fence the draws of this frame's data and go on to the next region */
+    void fence ();
+
+protected:
+    void allocate (size_t size);
+    void map ();
+    void reserve (size_t bytes);
+
+    GLuint id;
+    bool persistent;
+    size_t region_size;
+    int region;
+    size_t used;
+    /* the whole buffer when mapped persistent */
+    uint8_t *base;
+    /* where this frame's region is mapped, while it is */
+    uint8_t *ptr;
+    bool writing;
+    bool mapped;
+    GLsync fences[STREAM_REGIONS];
 };
 
 enum CameraDir {
@@ -60,6 +161,13 @@ public:
     /* the view the camera has in 3D space */
     glm::mat4 view ();
 
+    /*
+     * Pixels on screen a unit wide object covers a unit away, the height of
+     * the screen over 2 tan(fov / 2).  Its size at distance d is size times
+     * this over d.
+     */
+    float pixel_scale ();
+
     /* set the current mode of the camera */
     void set_mode (CameraMode mode);
 
@@ -111,22 +219,86 @@ public:
 
     void handle_input ();
 
+    /* take the next key pressed during the last handle_input */
+    bool next_key (SDL_Scancode &key);
+
+    /* take the next mouse button clicked during the last handle_input */
+    bool next_click (int &button);
+
+    /*
+     * The ray from the camera through the mouse, found by unprojecting the
+     * mouse at the near and far planes.  `dir' runs from near to far.
+     */
+    void mouse_ray (glm::vec3 &origin, glm::vec3 &dir);
+
+    /* draw the wireframe placeholder cube at x, y, z or not at all */
+    void set_placeholder (bool shown, float x, float y, float z);
+
     void lookat (float x, float y, float z, float zoom);
 
+    /* the camera's projection times its view */
+    glm::mat4 view_projection ();
+
+    /* where the camera is and its pixel_scale */
+    glm::vec3 eye ();
+    float pixel_scale ();
+
     /* Give info about what to draw and where */
     void draw_cube (float x, float y, float z);
-    
-    /* Clear the window, draw the internal objects, and flip */
+
+    /*
+     * Draw a box from min to max standing in for the cells inside of it,
+     * darker the less of it is occupied, from 0 to 1.
+     */
+    void draw_box (glm::vec3 min, glm::vec3 max, float occupancy);
+
+    /*
+     * Replace the mesh drawn for chunk `id' with `vertices', given as
+     * position then normal like the cube's.  Meshes are kept and drawn every
+     * frame until replaced.
+     */
+    void set_chunk_mesh (int id, const std::vector<float> &vertices);
+
+    /*
+     * Draw a bar over the top left of the window for each of `ms', top to
+     * bottom, in a color of its own and STATS_WIDTH pixels long for 1/60 s,
+     * with a tick where 1/60 s ends.
+     */
+    void draw_stats (const std::vector<double> &ms);
+
+    /*
+     * Clear the window, draw the internal objects, and flip.  The CPU time
+     * of each part and the GPU time of the drawing go to the profiler.
+     */
     void render ();
 
 protected:
+    /* the vertices of one chunk of the board on the GPU */
+    struct ChunkMesh {
+        GLuint VAO;
+        GLuint VBO;
+        GLsizei count;
+    };
+
+    /* per-frame data shared by the shaders, laid out as std140 */
+    struct FrameBlock {
+        glm::mat4 projection;
+        glm::mat4 view;
+        glm::vec4 light_pos;
+    };
+
     bool should_quit;
 
     unsigned long delta_time;
     unsigned long last_frame;
 
     glm::vec3 placeholder;
-    std::vector<glm::vec3> object_positions;
+    bool show_placeholder;
+    std::vector<SDL_Scancode> pressed;
+    std::vector<int> clicks;
+    /* where the mouse last was in the window */
+    int mouse_x;
+    int mouse_y;
 
     Camera camera;
     Shader shader;
@@ -135,4 +307,37 @@ protected:
     SDL_Event e;
     GLuint VAO;
     GLuint VBO;
+    /* uniform buffer holding the FrameBlock and the last one uploaded */
+    GLuint frame_UBO;
+    FrameBlock frame;
+    /* per-cube offsets drawn as instances of the cube in VBO */
+    StreamBuffer cubes;
+    GLuint offset_id;
+    /*
+     * The cube again, with boxes drawn as its instances: per-box offsets
+     * then sizes and occupancy.
+     */
+    GLuint box_VAO;
+    StreamBuffer boxes;
+    GLuint size_id;
+    GLuint vertex_id;
+    GLuint norm_id;
+    std::vector<ChunkMesh> chunk_meshes;
+    /*
+     * The bars of the stats, drawn flat over everything by a shader of their
+     * own from corners in clip space and colors, refilled every frame.
+     */
+    Shader overlay;
+    GLuint overlay_VAO;
+    GLuint overlay_VBO;
+    std::vector<float> bars;
+    /*
+     * Timer queries around the drawing of the last frames, read back once
+     * the GPU is done with them so reading never waits, and the time each
+     * frame's drawing began on the CPU.
+     */
+    GLuint gpu_queries[GPU_QUERIES];
+    uint64_t gpu_started[GPU_QUERIES];
+    bool gpu_pending[GPU_QUERIES];
+    int gpu_query;
 };
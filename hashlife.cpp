@@ -0,0 +1,510 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "hashlife.hpp"
+
+/* the smallest root, so that a root always has nodes for grandchildren */
+#define MIN_LEVEL 4
+
+/* bits of an 8x8 plane of cells (bit y * 8 + z) at z = 0 and z = 7 */
+#define PLANE_Z0 0x0101010101010101ULL
+#define PLANE_Z7 0x8080808080808080ULL
+
+static inline uint64_t
+mix (uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 33);
+}
+
+static uint64_t
+hash_node (int level, const uint32_t *child, uint64_t bits)
+{
+    if (!child)
+        return mix(bits + level);
+
+    uint64_t h = level;
+    for (int i = 0; i < 8; i++)
+        h = mix(h + child[i]);
+    return h;
+}
+
+/*
+ * Step an 8x8x8 cube of cells one generation, each x-plane of it a word.
+ * Cells outside of the cube are dead, so the step is only right one cell
+ * further in from the faces than before.
+ */
+static void
+step_cube (uint64_t plane[8], uint32_t birth, uint32_t survive)
+{
+    uint64_t next[8];
+
+    for (int x = 0; x < 8; x++) {
+        /* the 5 bits of every cell's count */
+        uint64_t count[5] = { 0, 0, 0, 0, 0 };
+
+        for (int dx = -1; dx <= 1; dx++) {
+            if (x + dx < 0 || x + dx > 7)
+                continue;
+            uint64_t p = plane[x + dx];
+            /* the plane seen from z + 1, z, z - 1 */
+            uint64_t zs[3] = { (p >> 1) & ~PLANE_Z7, p, (p << 1) & ~PLANE_Z0 };
+
+            for (int dz = 0; dz < 3; dz++) {
+                uint64_t ys[3] = { zs[dz] >> 8, zs[dz], zs[dz] << 8 };
+                for (int dy = 0; dy < 3; dy++) {
+                    if (dx == 0 && dy == 1 && dz == 1)
+                        continue;
+                    uint64_t carry = ys[dy];
+                    for (int b = 0; b < 5 && carry; b++) {
+                        uint64_t t = count[b] & carry;
+                        count[b] ^= carry;
+                        carry = t;
+                    }
+                }
+            }
+        }
+
+        uint64_t born = 0, stay = 0;
+        for (int n = 0; n <= MAX_NEIGHBORS; n++) {
+            if (!((birth | survive) >> n & 1))
+                continue;
+            uint64_t eq = ~0ULL;
+            for (int b = 0; b < 5; b++)
+                eq &= (n >> b) & 1 ? count[b] : ~count[b];
+            if ((birth >> n) & 1)
+                born |= eq;
+            if ((survive >> n) & 1)
+                stay |= eq;
+        }
+        next[x] = (plane[x] & stay) | (~plane[x] & born);
+    }
+    memcpy(plane, next, sizeof(next));
+}
+
+HashLife::HashLife (const Rule &rule, size_t limit)
+    : rule(rule)
+    , limit(limit)
+    , used(0)
+    , root(0)
+    , steps(0)
+{
+    if (rule.kind != Rule::LIFE) {
+        fprintf(stderr, "Only Life rules can be stepped by HashLife, not %s\n",
+                format_rule(rule).c_str());
+        exit(1);
+    }
+    if (rule.boundary != Rule::WALL) {
+        fprintf(stderr, "HashLife's space has no edges to wrap or mirror, "
+                        "step %s without -L\n", format_rule(rule).c_str());
+        exit(1);
+    }
+    origin[0] = origin[1] = origin[2] = 0;
+    nodes.push_back(Node());
+    buckets.assign(1024, 0);
+}
+
+/* the one node with these children, or these cells for a leaf */
+uint32_t
+HashLife::find (int level, const uint32_t *child, uint64_t bits)
+{
+    uint64_t h = hash_node(level, child, bits);
+    uint32_t *bucket = &buckets[h & (buckets.size() - 1)];
+
+    for (uint32_t n = *bucket; n; n = nodes[n].next) {
+        const Node &node = nodes[n];
+        if (node.level != level)
+            continue;
+        if (child ? !memcmp(node.child, child, sizeof(node.child))
+                  : node.bits == bits)
+            return n;
+    }
+
+    uint32_t n;
+    if (!free_nodes.empty()) {
+        n = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    else {
+        n = nodes.size();
+        nodes.push_back(Node());
+    }
+
+    Node &node = nodes[n];
+    memset(&node, 0, sizeof(Node));
+    node.level = level;
+    if (child) {
+        memcpy(node.child, child, sizeof(node.child));
+        for (int i = 0; i < 8; i++)
+            node.population += nodes[child[i]].population;
+    }
+    else {
+        node.bits = bits;
+        node.population = __builtin_popcountll(bits);
+    }
+    node.next = *bucket;
+    *bucket = n;
+
+    if (++used > buckets.size())
+        rehash(buckets.size() * 2);
+    return n;
+}
+
+uint32_t
+HashLife::leaf (uint64_t bits)
+{
+    return find(2, NULL, bits);
+}
+
+uint32_t
+HashLife::join (const uint32_t child[8])
+{
+    return find(nodes[child[0]].level + 1, child, 0);
+}
+
+uint32_t
+HashLife::empty (int level)
+{
+    while ((int) empties.size() <= level) {
+        int l = empties.size();
+        if (l < 2) {
+            empties.push_back(0);
+        }
+        else if (l == 2) {
+            empties.push_back(leaf(0));
+        }
+        else {
+            uint32_t child[8];
+            std::fill(child, child + 8, empties[l - 1]);
+            empties.push_back(join(child));
+        }
+    }
+    return empties[level];
+}
+
+/* the grandchild x, y, z (each 0 to 3) of a node of level 4 or more */
+uint32_t
+HashLife::grandchild (uint32_t n, int x, int y, int z) const
+{
+    uint32_t c = nodes[n].child[(x >> 1) | (y >> 1) << 1 | (z >> 1) << 2];
+    return nodes[c].child[(x & 1) | (y & 1) << 1 | (z & 1) << 2];
+}
+
+/* a cell (each coordinate 0 to 7) of a node of level 3 */
+int
+HashLife::cell (uint32_t n, int x, int y, int z) const
+{
+    uint32_t c = nodes[n].child[(x >> 2) | (y >> 2) << 1 | (z >> 2) << 2];
+    return (nodes[c].bits >> (((x & 3) * 4 + (y & 3)) * 4 + (z & 3))) & 1;
+}
+
+/* the center of a node, half as wide and at the same generation */
+uint32_t
+HashLife::centre (uint32_t n)
+{
+    if (nodes[n].level == 3) {
+        uint64_t bits = 0;
+        for (int x = 0; x < 4; x++)
+            for (int y = 0; y < 4; y++)
+                for (int z = 0; z < 4; z++)
+                    bits |= (uint64_t) cell(n, x + 2, y + 2, z + 2)
+                            << ((x * 4 + y) * 4 + z);
+        return leaf(bits);
+    }
+
+    uint32_t child[8];
+    for (int o = 0; o < 8; o++)
+        child[o] = grandchild(n, 1 + (o & 1), 1 + (o >> 1 & 1), 1 + (o >> 2));
+    return join(child);
+}
+
+/* the result of a node of level 3, by stepping its cells directly */
+uint32_t
+HashLife::base (uint32_t n, int k)
+{
+    uint64_t plane[8];
+    for (int x = 0; x < 8; x++) {
+        plane[x] = 0;
+        for (int y = 0; y < 8; y++)
+            for (int z = 0; z < 8; z++)
+                plane[x] |= (uint64_t) cell(n, x, y, z) << (y * 8 + z);
+    }
+
+    for (int g = 0; g < 1 << k; g++)
+        step_cube(plane, rule.birth, rule.survive);
+
+    uint64_t bits = 0;
+    for (int x = 0; x < 4; x++)
+        for (int y = 0; y < 4; y++)
+            for (int z = 0; z < 4; z++)
+                bits |= ((plane[x + 2] >> ((y + 2) * 8 + z + 2)) & 1)
+                        << ((x * 4 + y) * 4 + z);
+    return leaf(bits);
+}
+
+/*
+ * The center of node n 2^k generations later, k being at most its level
+ * minus 2.  At the most k, both rounds of results step the node; otherwise
+ * the first round only takes centers and the second steps 2^k.
+ */
+uint32_t
+HashLife::result (uint32_t n, int k)
+{
+    int level = nodes[n].level;
+
+    if (nodes[n].result && nodes[n].result_step == k)
+        return nodes[n].result;
+    if (nodes[n].population == 0)
+        return empty(level - 1);
+
+    uint32_t r;
+    if (level == 3) {
+        r = base(n, k);
+    }
+    else {
+        /* 27 overlapping nodes of level - 1, stepped or centered */
+        uint32_t mid[3][3][3];
+        for (int x = 0; x < 3; x++) {
+            for (int y = 0; y < 3; y++) {
+                for (int z = 0; z < 3; z++) {
+                    uint32_t child[8];
+                    for (int o = 0; o < 8; o++)
+                        child[o] = grandchild(n, x + (o & 1), y + (o >> 1 & 1),
+                                              z + (o >> 2));
+                    uint32_t sub = join(child);
+                    mid[x][y][z] = k == level - 2 ? result(sub, k - 1)
+                                                  : centre(sub);
+                }
+            }
+        }
+
+        /* 8 nodes of those, stepped into the 8 children of the result */
+        uint32_t out[8];
+        for (int o = 0; o < 8; o++) {
+            int x = o & 1, y = o >> 1 & 1, z = o >> 2;
+            uint32_t child[8];
+            for (int i = 0; i < 8; i++)
+                child[i] = mid[x + (i & 1)][y + (i >> 1 & 1)][z + (i >> 2)];
+            out[o] = result(join(child), k == level - 2 ? k - 1 : k);
+        }
+        r = join(out);
+    }
+
+    nodes[n].result = r;
+    nodes[n].result_step = k;
+    return r;
+}
+
+/* a node twice as wide with n at its center */
+uint32_t
+HashLife::expand (uint32_t n)
+{
+    int level = nodes[n].level;
+    uint32_t e = empty(level - 1);
+    uint32_t child[8];
+
+    for (int o = 0; o < 8; o++) {
+        uint32_t ring[8];
+        std::fill(ring, ring + 8, e);
+        ring[7 - o] = nodes[n].child[o];
+        child[o] = join(ring);
+    }
+    for (int i = 0; i < 3; i++)
+        origin[i] -= (int64_t) 1 << (level - 1);
+    return join(child);
+}
+
+/* whether every living cell of n is in its center half */
+bool
+HashLife::centred (uint32_t n) const
+{
+    for (int o = 0; o < 8; o++) {
+        uint32_t c = nodes[n].child[o];
+        for (int g = 0; g < 8; g++)
+            if (g != 7 - o && nodes[nodes[c].child[g]].population != 0)
+                return false;
+    }
+    return true;
+}
+
+/* node n with its cell x, y, z living */
+uint32_t
+HashLife::set (uint32_t n, int x, int y, int z)
+{
+    int level = nodes[n].level;
+    if (level == 2)
+        return leaf(nodes[n].bits | 1ULL << ((x * 4 + y) * 4 + z));
+
+    int half = 1 << (level - 1);
+    int o = (x >= half) | (y >= half) << 1 | (z >= half) << 2;
+    uint32_t child[8];
+    memcpy(child, nodes[n].child, sizeof(child));
+    child[o] = set(child[o], x & (half - 1), y & (half - 1), z & (half - 1));
+    return join(child);
+}
+
+void
+HashLife::load (const Board &board)
+{
+    nodes.resize(1);
+    free_nodes.clear();
+    empties.clear();
+    buckets.assign(buckets.size(), 0);
+    used = 0;
+    steps = 0;
+    origin[0] = origin[1] = origin[2] = 0;
+
+    int level = MIN_LEVEL;
+    int size = std::max(board.size_x, std::max(board.size_y, board.size_z));
+    while ((1 << level) < size)
+        level++;
+
+    root = empty(level);
+    board.each_live([&](int x, int y, int z) {
+        root = set(root, x, y, z);
+    });
+}
+
+void
+HashLife::store (uint32_t n, int64_t x, int64_t y, int64_t z,
+                 Board &board) const
+{
+    const Node &node = nodes[n];
+    int64_t size = (int64_t) 1 << node.level;
+
+    if (node.population == 0)
+        return;
+    if (x >= board.size_x || y >= board.size_y || z >= board.size_z ||
+            x + size <= 0 || y + size <= 0 || z + size <= 0)
+        return;
+
+    if (node.level == 2) {
+        for (uint64_t bits = node.bits; bits; bits &= bits - 1) {
+            int i = __builtin_ctzll(bits);
+            int64_t cx = x + (i >> 4), cy = y + (i >> 2 & 3), cz = z + (i & 3);
+            if (cx >= 0 && cy >= 0 && cz >= 0 && cx < board.size_x &&
+                    cy < board.size_y && cz < board.size_z)
+                board.set(cx, cy, cz, LIVE);
+        }
+        return;
+    }
+
+    int64_t half = size / 2;
+    for (int o = 0; o < 8; o++)
+        store(node.child[o], x + (o & 1) * half, y + (o >> 1 & 1) * half,
+              z + (o >> 2) * half, board);
+}
+
+void
+HashLife::store (Board &board) const
+{
+    store(root, origin[0], origin[1], origin[2], board);
+}
+
+/*
+ * Grow the root until its living cells lie in its center half and it is
+ * wide enough to step 2^k at once, then once more so they can't reach past
+ * the center of the new root in 2^k generations.  The result is the new
+ * root.
+ */
+void
+HashLife::step (int k)
+{
+    while (nodes[root].level < k + 2 || !centred(root))
+        root = expand(root);
+    root = expand(root);
+
+    int level = nodes[root].level;
+    root = result(root, k);
+    for (int i = 0; i < 3; i++)
+        origin[i] += (int64_t) 1 << (level - 2);
+    steps += 1UL << k;
+
+    if (used > limit)
+        collect();
+}
+
+void
+HashLife::run (unsigned long generations)
+{
+    for (int k = 0; generations; k++, generations >>= 1)
+        if (generations & 1)
+            step(k);
+}
+
+unsigned long
+HashLife::generation () const
+{
+    return steps;
+}
+
+double
+HashLife::population () const
+{
+    return nodes[root].population;
+}
+
+size_t
+HashLife::size () const
+{
+    return used;
+}
+
+void
+HashLife::rehash (size_t count)
+{
+    buckets.assign(count, 0);
+    for (uint32_t n = 1; n < nodes.size(); n++) {
+        Node &node = nodes[n];
+        if (node.level < 0)
+            continue;
+        uint64_t h = hash_node(node.level, node.level == 2 ? NULL : node.child,
+                               node.bits);
+        uint32_t *bucket = &buckets[h & (count - 1)];
+        node.next = *bucket;
+        *bucket = n;
+    }
+}
+
+void
+HashLife::mark (uint32_t n)
+{
+    if (nodes[n].mark)
+        return;
+    nodes[n].mark = true;
+    if (nodes[n].level > 2)
+        for (int i = 0; i < 8; i++)
+            mark(nodes[n].child[i]);
+}
+
+void
+HashLife::collect ()
+{
+    mark(root);
+    for (auto e : empties)
+        if (e)
+            mark(e);
+
+    for (uint32_t n = 1; n < nodes.size(); n++) {
+        Node &node = nodes[n];
+        if (node.level < 0)
+            continue;
+        if (!node.mark) {
+            node.level = -1;
+            free_nodes.push_back(n);
+            used--;
+        }
+    }
+    for (uint32_t n = 1; n < nodes.size(); n++) {
+        Node &node = nodes[n];
+        if (node.level < 0)
+            continue;
+        if (node.result && nodes[node.result].level < 0)
+            node.result = 0;
+        node.mark = false;
+    }
+    rehash(buckets.size());
+}
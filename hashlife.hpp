@@ -0,0 +1,108 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "board.hpp"
+#include "rule.hpp"
+
+/* nodes a HashLife keeps before it collects the ones it no longer needs */
+#define HASH_NODES (1 << 22)
+
+/*
+ * A 3D Hashlife for Life rules: the board as an octree whose nodes are
+ * hash-consed, so every distinct cube of cells is stored once however often
+ * it repeats, and where the future of every node is memoized.  A node of
+ * level k is a cube 2^k cells wide.  Level 2 nodes, 4x4x4 cells, are leaves
+ * holding their cells in one word, bit (x * 4 + y) * 4 + z.
+ *
+ * The result of a node of level k is the cube of its center 2^(k-1) wide,
+ * 2^j generations later for any j <= k - 2.  It is found from the results of
+ * 27 overlapping nodes of level k - 1, then of 8 more made from those, so a
+ * repetitive pattern is stepped 2^j generations at once while only its
+ * distinct parts are ever computed.
+ *
+ * Unlike a Board, space has no edges: cells are never clipped, and living
+ * cells only leave the octree by dying.  Nodes are kept in one array and
+ * referred to by index.  Once more than `limit' nodes are in use after a
+ * step, every node the board no longer reaches is collected and memoized
+ * results pointing at them are forgotten.
+ */
+class HashLife {
+public:
+    /* only rules of the Life kind can be memoized */
+    HashLife (const Rule &rule, size_t limit = HASH_NODES);
+
+    /* make the living cells of a board the universe, at the same positions */
+    void load (const Board &board);
+
+    /* set the living cells of the universe inside of a cleared board */
+    void store (Board &board) const;
+
+    /* step 2^k generations at once */
+    void step (int k);
+
+    /* step any number of generations, as jumps of powers of two */
+    void run (unsigned long generations);
+
+    /* generations stepped since the board was loaded */
+    unsigned long generation () const;
+
+    /* number of living cells */
+    double population () const;
+
+    /* number of nodes in use */
+    size_t size () const;
+
+    /* free every node the universe no longer reaches */
+    void collect ();
+
+protected:
+    struct Node {
+        uint32_t child[8];
+        /* the cells of a leaf */
+        uint64_t bits;
+        double population;
+        /* the next node in the same hash bucket */
+        uint32_t next;
+        /* the memoized result, 0 if none, and log2 of its generations */
+        uint32_t result;
+        int8_t result_step;
+        /* level of the node, -1 while it is free */
+        int8_t level;
+        bool mark;
+    };
+
+    uint32_t find (int level, const uint32_t *child, uint64_t bits);
+    uint32_t leaf (uint64_t bits);
+    uint32_t join (const uint32_t child[8]);
+    uint32_t empty (int level);
+    uint32_t grandchild (uint32_t n, int x, int y, int z) const;
+    int cell (uint32_t n, int x, int y, int z) const;
+
+    uint32_t centre (uint32_t n);
+    uint32_t base (uint32_t n, int k);
+    uint32_t result (uint32_t n, int k);
+    uint32_t expand (uint32_t n);
+    bool centred (uint32_t n) const;
+
+    uint32_t set (uint32_t n, int x, int y, int z);
+    void store (uint32_t n, int64_t x, int64_t y, int64_t z,
+                Board &board) const;
+
+    void rehash (size_t count);
+    void mark (uint32_t n);
+
+    Rule rule;
+    size_t limit;
+    /* node 0 is never used, so index 0 can mean none */
+    std::vector<Node> nodes;
+    std::vector<uint32_t> buckets;
+    std::vector<uint32_t> free_nodes;
+    /* the empty node of every level made so far */
+    std::vector<uint32_t> empties;
+    size_t used;
+
+    uint32_t root;
+    /* the world position of the root's lowest corner */
+    int64_t origin[3];
+    unsigned long steps;
+};
@@ -1,166 +1,549 @@
+#include <algorithm>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
 #include <time.h>
+#include <unistd.h>
 #include "draw.hpp"
+#include "board.hpp"
+#include "cluster.hpp"
+#include "hashlife.hpp"
+#include "mesh.hpp"
 #include "octree.hpp"
+#include "profile.hpp"
+#include "record.hpp"
+#include "sim.hpp"
 
-#define BOARD_X   32
-#define BOARD_Y   32
-#define BOARD_Z   32
-#define LIVE      1
-#define DEAD      0
-#define PERIOD 	  250
-
-static int curr_board[BOARD_X][BOARD_Y][BOARD_Z] = {};
-static int next_board[BOARD_X][BOARD_Y][BOARD_Z] = {};
+#define BOARD_SIZE 32
+#define HISTORY    8
+/* milliseconds a frame may spend rebuilding chunk meshes */
+#define MESH_BUDGET 4.0
+/* subtrees drawn narrower than this many pixels are drawn as one box */
+#define LOD_PIXELS  1.0
+/* how far around a cell N counts the living cells, and how many are listed */
+#define NEIGHBORHOOD 4
+#define NEAREST      6
 
 void
-init_board ()
+init_board (Board &board)
 {
-    for (int x = 0; x < BOARD_X; x++)
-        for (int y = 0; y < BOARD_Y; y++)
-            for (int z = 0; z < BOARD_Z; z++)
+    for (int x = 0; x < board.size_x; x++)
+        for (int y = 0; y < board.size_y; y++)
+            for (int z = 0; z < board.size_z; z++)
                 if (rand() % 500 > 490)
-                    curr_board[x][y][z] = 1;
+                    board.set(x, y, z, LIVE);
                 else
-                    curr_board[x][y][z] = 0;
+                    board.set(x, y, z, DEAD);
 }
 
 /*
- * Count each neighbor either being dead or living.  This board does not loop
- * so edges & corners will have less possible neighbors.
+ * Step the board a generation.  With a pool the step is split across its
+ * threads and `seed' picks the random moves.
  */
-int
-cell_neighbors (int x, int y, int z, int type)
+void
+advance_board (History &history, ThreadPool *pool, uint64_t seed)
 {
-    int neighbors = 0;
-
-    for (int dy = y - 1; dy <= y + 1; dy++) {
-        if (dy < 0)
-            continue;
-        if (dy > BOARD_Y)
-            continue;
-
-        /* center */
-        if (dy != y && curr_board[x][dy][z] == type)
-            neighbors++;
-
-        /* top */
-        if (z < BOARD_Z && curr_board[x][dy][z + 1] == type)
-                neighbors++;
-        /* right */
-        if (x < BOARD_X && curr_board[x + 1][dy][z] == type)
-                neighbors++;
-        /* bottom */
-        if (z > 0 && curr_board[x][dy][z - 1] == type)
-                neighbors++;
-        /* left */
-        if (x > 0 && curr_board[x - 1][dy][z] == type)
-                neighbors++;
-
-        /* top left */
-        if ((x > 0 && z < BOARD_Z) && curr_board[x - 1][dy][z + 1] == type)
-                neighbors++;
-        /* top right */
-        if (x < BOARD_X && z < BOARD_Z && curr_board[x + 1][dy][z + 1] == type)
-                neighbors++;
-        /* bottom right */
-        if (x < BOARD_X && z > 0 && curr_board[x + 1][dy][z - 1] == type)
-                neighbors++;
-        /* bottom left */
-        if (x > 0 && z > 0 && curr_board[x - 1][dy][z - 1] == type)
-                neighbors++;
+    if (pool)
+        history.step(*pool, seed + history.generation());
+    else
+        history.step();
+}
+
+/*
+ * Step the board for some generations without ever opening a window.  The
+ * population of every generation goes to stdout and the rate of stepping to
+ * stderr.  Only the steps themselves are timed, not recording them.
+ */
+void
+run_headless (History &history, ThreadPool *pool, uint64_t seed,
+              unsigned long generations, Recorder *recorder)
+{
+    typedef std::chrono::steady_clock clock;
+    const Board &board = history.current();
+    double cells = (double) board.size_x * board.size_y * board.size_z;
+    double elapsed = 0;
+
+    printf("%lu %lu\n", history.generation(), history.current().population());
+
+    for (unsigned long i = 0; i < generations; i++) {
+        clock::time_point start = clock::now();
+        advance_board(history, pool, seed);
+        elapsed += std::chrono::duration<double>(clock::now() - start).count();
+
+        if (recorder)
+            recorder->record(history.current());
+
+        printf("%lu %lu\n", history.generation(),
+               history.current().population());
     }
 
-    return neighbors;
+    fprintf(stderr, "%lu generations of %.0f cells in %.3f s\n"
+                    "%.2f generations/s\n"
+                    "%.4g cells/s\n",
+                    generations, cells, elapsed,
+                    generations / elapsed,
+                    cells * generations / elapsed);
 }
 
+/*
+ * Step the board for some generations with HashLife, in jumps of powers of
+ * two.  The generation and population after every jump go to stdout, as
+ * in run_headless.  Space has no edges, so cells are never clipped by the
+ * board's bounds.
+ */
 void
-step_board ()
+run_hashlife (const Board &board, const Rule &rule, unsigned long generations)
 {
-    int neighbors;
-    int axis;
-    int dir;
-    int ix, iy, iz;
-
-    for (int x = 0; x < BOARD_X; x++) {
-        for (int y = 0; y < BOARD_Y; y++) {
-            for (int z = 0; z < BOARD_Z; z++) {
-                //if (curr_board[x][y][z] == LIVE) {
-                //    neighbors = cell_neighbors(x, y, z, LIVE);
-                //    if (neighbors < 6 || neighbors > 10)
-                //        next_board[x][y][z] = DEAD;
-                //    else
-                //        next_board[x][y][z] = LIVE;
-                //}
-                //else if (neighbors == 10) {
-                //    next_board[x][y][z] = LIVE;
-                //}
-
-                if (curr_board[x][y][z] == DEAD)
-                    continue;
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    HashLife life(rule);
 
-                neighbors = cell_neighbors(x, y, z, LIVE);
-                if (neighbors > 18) {
-                    next_board[x][y][z] = LIVE;
-                }
-                else {
-                    dir = (rand() % 2);
-                    axis = rand() % 100;
-
-                    if (dir)
-                        dir = -1;
-                    else
-                        dir = 1;
-
-                    ix = x;
-                    iy = y;
-                    iz = z;
-
-                    if (axis < 33 && x > 0 && x < BOARD_X - 1)
-                        ix += dir;
-                    else if (axis < 66 && y > 0 && y < BOARD_Y - 1)
-                        iy += dir;
-                    else if (z > 0 && z < BOARD_Z - 1)
-                        iz += dir;
-
-                    if (next_board[ix][iy][iz] == DEAD)
-                        next_board[ix][iy][iz] = LIVE;
-                    else
-                        next_board[x][y][z] = LIVE;
-                }
-            }
+    life.load(board);
+    printf("%lu %.0f\n", life.generation(), life.population());
+
+    for (int k = 0; generations; k++, generations >>= 1) {
+        if (generations & 1) {
+            life.step(k);
+            printf("%lu %.0f\n", life.generation(), life.population());
         }
     }
 
-    memcpy(curr_board, next_board, BOARD_X * BOARD_Y * BOARD_Z * sizeof(int));
-    memset(next_board, 0, BOARD_X * BOARD_Y * BOARD_Z * sizeof(int));
+    fprintf(stderr, "%lu generations in %.3f s\n"
+                    "%zu nodes\n",
+                    life.generation(),
+                    std::chrono::duration<double>(clock::now() - start).count(),
+                    life.size());
+}
+
+/* build a tree of the living cells of a board */
+Octree
+index_board (const Board &board)
+{
+    std::vector<vec3> cells;
+    board.each_live([&](int x, int y, int z) {
+        cells.push_back(vec3(x, y, z));
+    });
+    return Octree(BoundingBox(vec3(0, 0, 0),
+                vec3(board.size_x, board.size_y, board.size_z)), cells);
+}
+
+/* bring a tree of the living cells of `before' up to those of `after' */
+void
+update_index (Octree &tree, const Board &before, const Board &after)
+{
+    std::vector<vec3> died;
+    std::vector<vec3> born;
+    each_change(before, after, [&](int x, int y, int z, int state) {
+        if (state == LIVE)
+            born.push_back(vec3(x, y, z));
+        else
+            died.push_back(vec3(x, y, z));
+    });
+    tree.update(died, born);
+}
+
+/*
+ * Print how many living cells are within NEIGHBORHOOD of the living cell at
+ * x, y, z and how far away the NEAREST nearest of them are.
+ */
+void
+print_neighborhood (const Octree &tree, int x, int y, int z)
+{
+    vec3 cell(x, y, z);
+    std::vector<vec3> near;
+    std::vector<vec3> nearest;
+
+    /* the cell finds itself too, so it is left out of both */
+    tree.query_radius(cell, NEIGHBORHOOD, near);
+    tree.nearest(cell, NEAREST + 1, nearest);
+    long others = std::count_if(near.begin(), near.end(),
+                                [&](vec3 p) { return p != cell; });
+    printf("%d %d %d: %ld living within %d, nearest at", x, y, z, others,
+           NEIGHBORHOOD);
+    for (auto &p : nearest)
+        if (p != cell)
+            printf(" %.2f", length(p - cell));
+    printf("\n");
+}
+
+/* write the timings kept, as CSV if the file is named so or else a trace */
+void
+write_profile (const char *path)
+{
+    size_t length = strlen(path);
+    bool csv = length >= 4 && strcmp(path + length - 4, ".csv") == 0;
+    if (!(csv ? profiler.write_csv(path) : profiler.write_trace(path)))
+        fprintf(stderr, "Could not write %s\n", path);
+}
+
+void
+usage (const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s size] [-x size] [-y size] [-z size] "
+                    "[-t threads] [-r depth] [-S seed] [-H generations] [-m]\n"
+                    "       [-R rule] [-L] [-w file] [-p file] [-P file]\n"
+                    "       [-d pixels] [-W port] [-N host:port,...]\n"
+                    "  -s  size of every dimension of the board\n"
+                    "  -x, -y, -z  size of a single dimension\n"
+                    "  -t  threads to step with, 0 for every core; at most\n"
+                    "      one per 16 planes of x is kept busy\n"
+                    "  -r  generations kept to step back through\n"
+                    "  -S  seed for the first board and the moves\n"
+                    "  -H  step this many generations without a window\n"
+                    "  -m  draw the board as meshes of its visible faces\n"
+                    "  -R  rule to step by: W19-26, B5/S4-5, B4/S4/C5, ...\n"
+                    "      ending in :T to wrap the edges, :M to mirror them\n"
+                    "      or :P, the default, to leave them dead\n"
+                    "  -L  with -H, jump through Life rules with HashLife\n"
+                    "  -w  record every generation stepped to a file\n"
+                    "  -p  play back a recording instead of stepping\n"
+                    "  -P  write how long each part of every frame and step\n"
+                    "      took, as CSV if named .csv or else a Chrome trace\n"
+                    "  -d  draw parts of the board narrower than this many\n"
+                    "      pixels as one box, 0 to draw every cell\n"
+                    "  -W  step domains of boards for others, listening on\n"
+                    "      this port\n"
+                    "  -N  with -H, step the board across these workers\n",
+                    prog);
+    exit(1);
 }
 
 int
 main (int argc, char **argv)
 {
-    unsigned long last_time = 0;
+    int size_x = BOARD_SIZE;
+    int size_y = BOARD_SIZE;
+    int size_z = BOARD_SIZE;
+    int threads = 1;
+    float lod_pixels = LOD_PIXELS;
+    int depth = HISTORY;
+    /* how many generations before the newest one received is being shown */
+    int back = 0;
+    /* with meshes, the last generation marked for remeshing */
+    bool meshes = false;
+    long marked = 0;
+    long shown;
+    /* without, the tree of living cells and the generation it holds */
+    Octree tree;
+    long indexed = -1;
+    unsigned long seed = time(NULL);
+    unsigned long headless = 0;
+    bool hashlife = false;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    Recorder *recorder = NULL;
+    /* when playing back, the recording and the generation of it shown */
+    Replay *replay = NULL;
+    long frame = 0;
+    bool replaying = false;
+    const char *profile_path = NULL;
+    /* a worker's port, or the workers to step across */
+    int worker_port = 0;
+    std::vector<std::string> workers;
+    /* whether the stats are shown, and when they were last printed */
+    bool stats = false;
+    unsigned long printed = 0;
+    /* whether N was pressed this frame */
+    bool inspect = false;
+    Rule rule;
+    SDL_Scancode key;
+    int button;
+    /* the cell under the mouse, and the cell next to it a click would set */
+    glm::vec3 origin, dir;
+    Hit hit;
+    bool picked;
+    bool placeable;
+    int opt;
+
+    const char *options = "s:x:y:z:t:r:S:H:mR:Lw:p:P:d:W:N:";
+    while ((opt = getopt(argc, argv, options)) != -1) {
+        switch (opt) {
+            case 's': size_x = size_y = size_z = atoi(optarg); break;
+            case 'x': size_x = atoi(optarg); break;
+            case 'y': size_y = atoi(optarg); break;
+            case 'z': size_z = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'r': depth = atoi(optarg); break;
+            case 'S': seed = strtoul(optarg, NULL, 10); break;
+            case 'H': headless = strtoul(optarg, NULL, 10); break;
+            case 'm': meshes = true; break;
+            case 'L': hashlife = true; break;
+            case 'w': record_path = optarg; break;
+            case 'p': replay_path = optarg; break;
+            case 'P': profile_path = optarg; break;
+            case 'd': lod_pixels = atof(optarg); break;
+            case 'W': worker_port = atoi(optarg); break;
+            case 'N':
+                for (const char *p = optarg; *p; p += *p == ',') {
+                    const char *end = p + strcspn(p, ",");
+                    workers.push_back(std::string(p, end));
+                    p = end;
+                }
+                break;
+            case 'R':
+                if (!parse_rule(optarg, rule)) {
+                    fprintf(stderr, "Not a rule: %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (worker_port > 0) {
+        ThreadPool steppers(threads);
+        run_worker(worker_port, steppers);
+        return 0;
+    }
+    if (!workers.empty() && (headless == 0 || hashlife || replay_path ||
+                             record_path))
+        usage(argv[0]);
+
+    /* a recording brings its own board, rule and seed */
+    if (replay_path) {
+        if (headless > 0 || record_path)
+            usage(argv[0]);
+        replay = new Replay(replay_path);
+        size_x = replay->header().size_x;
+        size_y = replay->header().size_y;
+        size_z = replay->header().size_z;
+        seed = replay->header().seed;
+        rule = replay->rule();
+    }
+
+    if (size_x <= 0 || size_y <= 0 || size_z <= 0)
+        usage(argv[0]);
+
+    if (profile_path)
+        profiler.keep(true);
+
+    History history(depth, size_x, size_y, size_z, rule);
+    ThreadPool *pool = threads != 1 ? new ThreadPool(threads) : NULL;
+
+    srand(seed);
+    if (replay)
+        replay->load(0, history.current());
+    else
+        init_board(history.current());
+
+    if (headless > 0 && hashlife) {
+        run_hashlife(history.current(), rule, headless);
+        if (profile_path)
+            write_profile(profile_path);
+        delete pool;
+        return 0;
+    }
+    if (!workers.empty()) {
+        run_cluster(history.current(), rule, seed, headless, workers);
+        delete pool;
+        return 0;
+    }
+    if (record_path)
+        recorder = new Recorder(record_path, history.current(), rule, seed);
+    if (headless > 0) {
+        run_headless(history, pool, seed, headless, recorder);
+        if (profile_path)
+            write_profile(profile_path);
+        delete recorder;
+        delete pool;
+        return 0;
+    }
+
     Window window;
-    window.lookat(BOARD_X / 2, BOARD_Y / 2, BOARD_Z / 2, BOARD_X * 5);
+    window.lookat(size_x / 2, size_y / 2, size_z / 2, size_x * 5);
+
+    /*
+     * The board is stepped on its own thread from here on, unless it is
+     * played back from a recording.
+     */
+    Simulation *sim = NULL;
+    const Snapshot *snapshot;
+    Board scratch(size_x, size_y, size_z, rule.layers());
+    if (!replay)
+        sim = new Simulation(history.current(), rule, pool, seed, recorder);
+
+    /* make a generation of the recording the newest one in the history */
+    auto seek = [&](long target) {
+        target = std::max(0L, std::min(target, (long) replay->frames() - 1));
+        if (target == frame)
+            return;
+        replay->load(target, scratch);
+        history.record(scratch);
+        frame = target;
+    };
 
-    srand(time(NULL));
-    init_board();
+    Remesher remesher(history.current());
+    auto upload = [&](int id, const std::vector<float> &vertices) {
+        window.set_chunk_mesh(id, vertices);
+    };
 
     while (!window.should_close()) {
+        ScopedTimer frame_timer(PHASE_FRAME);
+        uint64_t input_start = profiler.now();
+        uint64_t collect_start;
+
         window.handle_input();
 
-        for (int x = 0; x < BOARD_X; x++)
-            for (int y = 0; y < BOARD_Y; y++)
-                for (int z = 0; z < BOARD_Z; z++)
-                    if (curr_board[x][y][z])
-                        window.draw_cube(x, y, z);
+        /*
+         * Keep the newest generation the simulation finished.  While looking
+         * back the same generation stays shown.
+         */
+        if (sim && (snapshot = sim->take()) != NULL) {
+            history.record(snapshot->board);
+            if (back > 0)
+                back = std::min(back + 1, history.available() - 1);
+        }
+
+        /*
+         * Left steps back through the history, right steps forward and space
+         * starts or stops stepping continuously.  A recording is scrubbed
+         * instead: left and right by a generation, comma and period by a
+         * keyframe, and space plays it a generation per frame.  F3 shows
+         * the time each part of a frame takes or stops, and N describes the
+         * cells around the one under the mouse once the tree is current.
+         */
+        while (window.next_key(key)) {
+            long interval = replay ? replay->header().interval : 0;
+            if (key == SDL_SCANCODE_F3) {
+                stats = !stats;
+                printed = 0;
+            }
+            else if (key == SDL_SCANCODE_N)
+                inspect = true;
+            else if (replay && key == SDL_SCANCODE_LEFT)
+                seek(frame - 1);
+            else if (replay && key == SDL_SCANCODE_RIGHT)
+                seek(frame + 1);
+            else if (replay && key == SDL_SCANCODE_COMMA)
+                seek(frame - interval);
+            else if (replay && key == SDL_SCANCODE_PERIOD)
+                seek(frame + interval);
+            else if (replay && key == SDL_SCANCODE_SPACE)
+                replaying = !replaying;
+            else if (replay)
+                continue;
+            else if (key == SDL_SCANCODE_LEFT && back < history.available() - 1)
+                back++;
+            else if (key == SDL_SCANCODE_RIGHT && back > 0)
+                back--;
+            else if (key == SDL_SCANCODE_RIGHT)
+                sim->request_step();
+            else if (key == SDL_SCANCODE_SPACE)
+                sim->play(!sim->playing());
+        }
+        if (replaying)
+            seek(frame + 1);
+
+        /*
+         * Only the chunks which changed since the last shown generation are
+         * remeshed, unless that generation has left the history.
+         */
+        shown = history.generation() - back;
+
+        /*
+         * Left sets the cell in front of the face under the mouse and right
+         * kills the cell under it, only on the newest generation.
+         */
+        window.mouse_ray(origin, dir);
+        picked = cast_ray(history.past(back), origin.x, origin.y, origin.z,
+                          dir.x, dir.y, dir.z, hit);
+        placeable = picked &&
+            hit.x + hit.nx >= 0 && hit.x + hit.nx < size_x &&
+            hit.y + hit.ny >= 0 && hit.y + hit.ny < size_y &&
+            hit.z + hit.nz >= 0 && hit.z + hit.nz < size_z;
+        window.set_placeholder(placeable, hit.x + hit.nx, hit.y + hit.ny,
+                               hit.z + hit.nz);
+
+        while (window.next_click(button)) {
+            int x = hit.x, y = hit.y, z = hit.z, state = DEAD;
+            if (!picked || back > 0 || !sim)
+                continue;
+            if (button == SDL_BUTTON_LEFT) {
+                if (!placeable)
+                    continue;
+                x += hit.nx;
+                y += hit.ny;
+                z += hit.nz;
+                state = LIVE;
+            }
+
+            /* the tree holds living cells, each only once */
+            bool was_live = history.current().get(x, y, z) == LIVE;
+            history.current().set(x, y, z, state);
+            sim->edit(x, y, z, state);
+            if (meshes)
+                remesher.mark_cell(x, y, z);
+            else if (indexed == shown && state == LIVE && !was_live)
+                tree.insert(vec3(x, y, z));
+            else if (indexed == shown && state == DEAD && was_live)
+                tree.erase(vec3(x, y, z));
+            picked = placeable = false;
+        }
+        collect_start = profiler.now();
+        profiler.add(PHASE_INPUT, input_start, collect_start - input_start);
+
+        if (meshes) {
+            if (shown != marked) {
+                long last = history.generation() - marked;
+                if (last < history.available())
+                    remesher.mark(history.past(last), history.past(back));
+                else
+                    remesher.mark_all();
+                marked = shown;
+            }
+            if (remesher.pending() > 0)
+                remesher.rebuild(history.past(back), MESH_BUDGET, upload);
+        }
+        else {
+            /*
+             * The tree is only changed where the cells did, unless the
+             * generation it holds has left the history.  Parts of it too far
+             * away to make out single cells are drawn as a box each.
+             */
+            if (shown != indexed) {
+                long last = history.generation() - indexed;
+                if (indexed >= 0 && last < history.available())
+                    update_index(tree, history.past(last), history.past(back));
+                else
+                    tree = index_board(history.past(back));
+                indexed = shown;
+            }
+            tree.visible_lod(Frustum(window.view_projection()), window.eye(),
+                             window.pixel_scale(), lod_pixels,
+                             [&](vec3 pos) {
+                                 window.draw_cube(pos.x, pos.y, pos.z);
+                             },
+                             [&](vec3 min, vec3 max, float occupancy) {
+                                 window.draw_box(min, max, occupancy);
+                             });
+        }
+        profiler.add(PHASE_COLLECT, collect_start,
+                     profiler.now() - collect_start);
+
+        /* meshes keep no tree, so one is built for the question */
+        if (inspect && picked)
+            print_neighborhood(meshes ? index_board(history.past(back)) : tree,
+                               hit.x, hit.y, hit.z);
+        inspect = false;
+
+        /* bars of the stats every frame, their numbers now and then */
+        if (stats) {
+            window.draw_stats(profiler.means());
+            if (window.get_ticks() - printed >= PROFILE_WINDOW) {
+                fprintf(stderr, "%s\n", profiler.summary().c_str());
+                printed = window.get_ticks();
+            }
+        }
 
-        //if (window.get_ticks() - last_time > PERIOD) {
-        //    step_board();
-        //    last_time = window.get_ticks();
-        //}
         window.render();
     }
 
+    delete sim;
+    if (profile_path)
+        write_profile(profile_path);
+    delete recorder;
+    delete replay;
+    delete pool;
     return 0;
 }
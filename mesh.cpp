@@ -0,0 +1,336 @@
+#include <chrono>
+#include "mesh.hpp"
+
+MeshGrid::MeshGrid (const Board &board)
+    : chunks_x((board.size_x + MESH_CHUNK - 1) / MESH_CHUNK)
+    , chunks_y((board.size_y + MESH_CHUNK - 1) / MESH_CHUNK)
+    , chunks_z((board.size_z + MESH_CHUNK - 1) / MESH_CHUNK)
+{ }
+
+int
+MeshGrid::count () const
+{
+    return chunks_x * chunks_y * chunks_z;
+}
+
+int
+MeshGrid::id (int cx, int cy, int cz) const
+{
+    return (cz * chunks_y + cy) * chunks_x + cx;
+}
+
+static inline void
+push_vertex (std::vector<float> &out, const float p[3], const float n[3])
+{
+    out.push_back(p[0]);
+    out.push_back(p[1]);
+    out.push_back(p[2]);
+    out.push_back(n[0]);
+    out.push_back(n[1]);
+    out.push_back(n[2]);
+}
+
+/*
+ * Add the quad with corner `o' and sides `u' and `v' facing along `n'.  The
+ * order of the corners is picked so the triangles are clockwise seen from
+ * the side the normal points to.
+ */
+static void
+emit_quad (std::vector<float> &out, const float o[3],
+           const float u[3], const float v[3], const float n[3])
+{
+    float a[3], b[3], c[3], d[3];
+    float cross[3];
+
+    for (int i = 0; i < 3; i++) {
+        a[i] = o[i];
+        b[i] = o[i] + u[i];
+        c[i] = o[i] + u[i] + v[i];
+        d[i] = o[i] + v[i];
+    }
+
+    cross[0] = u[1] * v[2] - u[2] * v[1];
+    cross[1] = u[2] * v[0] - u[0] * v[2];
+    cross[2] = u[0] * v[1] - u[1] * v[0];
+
+    if (cross[0] * n[0] + cross[1] * n[1] + cross[2] * n[2] < 0) {
+        push_vertex(out, a, n); push_vertex(out, b, n); push_vertex(out, c, n);
+        push_vertex(out, a, n); push_vertex(out, c, n); push_vertex(out, d, n);
+    }
+    else {
+        push_vertex(out, a, n); push_vertex(out, c, n); push_vertex(out, b, n);
+        push_vertex(out, a, n); push_vertex(out, d, n); push_vertex(out, c, n);
+    }
+}
+
+/*
+ * Merge the faces of one slice into quads.  Row `a' of the slice has bit `b'
+ * set for every face at (a, b).  Runs of bits in a row are grown along the
+ * following rows for as long as every one of them has the same run, then
+ * `quad(a, b, h, w)' is called for the rows [a, a + h) and bits [b, b + w).
+ */
+template <typename F>
+static void
+greedy (uint32_t rows[MESH_CHUNK], F quad)
+{
+    for (int a = 0; a < MESH_CHUNK; a++) {
+        while (rows[a]) {
+            int b = __builtin_ctz(rows[a]);
+            int w = __builtin_ctz(~(rows[a] >> b));
+            uint32_t run = ((1u << w) - 1) << b;
+            int h = 1;
+
+            rows[a] &= ~run;
+            while (a + h < MESH_CHUNK && (rows[a + h] & run) == run) {
+                rows[a + h] &= ~run;
+                h++;
+            }
+            quad(a, b, h, w);
+        }
+    }
+}
+
+/*
+ * The cells of the chunk and a ring of cells around it are gathered into
+ * rows of bits along z, bit 1 being the chunk's first z.  Rows inside the
+ * chunk also get the cells just before and after it along z in bits 0 and
+ * MESH_CHUNK + 1.  The faces looking along each axis are then a row and its
+ * neighbor's row with the neighbor's cells removed.
+ */
+void
+mesh_chunk (const Board &board, int cx, int cy, int cz,
+            std::vector<float> &vertices)
+{
+    const int S = MESH_CHUNK;
+    const uint32_t cells = ((1u << S) - 1) << 1;
+    int x0 = cx * S, y0 = cy * S, z0 = cz * S;
+    int w = z0 >> 6, shift = z0 & 63;
+    uint32_t r[S + 2][S + 2];
+
+    for (int i = 0; i < S + 2; i++) {
+        for (int j = 0; j < S + 2; j++) {
+            int x = x0 + i - 1, y = y0 + j - 1;
+            r[i][j] = 0;
+            if (x > board.size_x || y > board.size_y)
+                continue;
+            r[i][j] = ((*board.row(x, y, w) >> shift) & 0xFFFF) << 1;
+            if (i > 0 && i <= S && j > 0 && j <= S) {
+                /* only living cells are solid, not the dying of Generations */
+                uint32_t below = board.get(x, y, z0 - 1) == LIVE;
+                uint32_t above = board.get(x, y, z0 + S) == LIVE;
+                r[i][j] |= below | above << (S + 1);
+            }
+        }
+    }
+
+    /* faces of the chunk, indexed [direction][first axis][second axis] */
+    uint32_t face[6][S][S];
+    for (int i = 0; i < S; i++) {
+        for (int j = 0; j < S; j++) {
+            uint32_t c = r[i + 1][j + 1] & cells;
+            face[0][i][j] = c & ~r[i + 2][j + 1];          /* +x */
+            face[1][i][j] = c & ~r[i][j + 1];              /* -x */
+            face[2][i][j] = c & ~r[i + 1][j + 2];          /* +y */
+            face[3][i][j] = c & ~r[i + 1][j];              /* -y */
+            face[4][i][j] = c & ~(r[i + 1][j + 1] >> 1);   /* +z */
+            face[5][i][j] = c & ~(r[i + 1][j + 1] << 1);   /* -z */
+        }
+    }
+
+    uint32_t rows[S];
+
+    /* faces along x: a slice per x, rows along y, bits along z */
+    for (int d = 0; d < 2; d++) {
+        float n[3] = { d ? -1.f : 1.f, 0, 0 };
+        for (int i = 0; i < S; i++) {
+            for (int j = 0; j < S; j++)
+                rows[j] = face[d][i][j] >> 1;
+            float px = x0 + i + n[0] * 0.5f;
+            greedy(rows, [&](int a, int b, int h, int len) {
+                float o[3] = { px, y0 + a - 0.5f, z0 + b - 0.5f };
+                float u[3] = { 0, (float) h, 0 };
+                float v[3] = { 0, 0, (float) len };
+                emit_quad(vertices, o, u, v, n);
+            });
+        }
+    }
+
+    /* faces along y: a slice per y, rows along x, bits along z */
+    for (int d = 2; d < 4; d++) {
+        float n[3] = { 0, d == 3 ? -1.f : 1.f, 0 };
+        for (int j = 0; j < S; j++) {
+            for (int i = 0; i < S; i++)
+                rows[i] = face[d][i][j] >> 1;
+            float py = y0 + j + n[1] * 0.5f;
+            greedy(rows, [&](int a, int b, int h, int len) {
+                float o[3] = { x0 + a - 0.5f, py, z0 + b - 0.5f };
+                float u[3] = { (float) h, 0, 0 };
+                float v[3] = { 0, 0, (float) len };
+                emit_quad(vertices, o, u, v, n);
+            });
+        }
+    }
+
+    /* faces along z: a slice per z, rows along x, bits along y */
+    for (int d = 4; d < 6; d++) {
+        float n[3] = { 0, 0, d == 5 ? -1.f : 1.f };
+        for (int k = 0; k < S; k++) {
+            for (int i = 0; i < S; i++) {
+                rows[i] = 0;
+                for (int j = 0; j < S; j++)
+                    rows[i] |= ((face[d][i][j] >> (k + 1)) & 1) << j;
+            }
+            float pz = z0 + k + n[2] * 0.5f;
+            greedy(rows, [&](int a, int b, int h, int len) {
+                float o[3] = { x0 + a - 0.5f, y0 + b - 0.5f, pz };
+                float u[3] = { (float) h, 0, 0 };
+                float v[3] = { 0, (float) len, 0 };
+                emit_quad(vertices, o, u, v, n);
+            });
+        }
+    }
+}
+
+void
+changed_chunks (const Board &a, const Board &b, const MeshGrid &grid,
+                std::vector<uint8_t> &dirty)
+{
+    const int S = MESH_CHUNK;
+    const int segments = 64 / S;
+
+    for (int w = 0; w < a.zwords; w++) {
+        for (int bx = 0; bx < a.chunks_x; bx++) {
+            for (int by = 0; by < a.chunks_y; by++) {
+                if (!a.chunk_at(bx, by, w) && !b.chunk_at(bx, by, w))
+                    continue;
+
+                int x1 = std::min(bx * CHUNK + CHUNK, a.size_x);
+                int y1 = std::min(by * CHUNK + CHUNK, a.size_y);
+                for (int x = bx * CHUNK; x < x1; x++) {
+                    for (int y = by * CHUNK; y < y1; y++) {
+                        uint64_t diff = *a.row(x, y, w) ^ *b.row(x, y, w);
+                        if (!diff)
+                            continue;
+
+                        int cx = x / S, cy = y / S;
+                        for (int seg = 0; seg < segments; seg++) {
+                            uint32_t d = (diff >> (seg * S)) & ((1u << S) - 1);
+                            if (!d)
+                                continue;
+
+                            int cz = (w * 64 + seg * S) / S;
+                            dirty[grid.id(cx, cy, cz)] = 1;
+
+                            /* changes on a border change the faces next door */
+                            if (x % S == 0 && cx > 0)
+                                dirty[grid.id(cx - 1, cy, cz)] = 1;
+                            if (x % S == S - 1 && cx + 1 < grid.chunks_x)
+                                dirty[grid.id(cx + 1, cy, cz)] = 1;
+                            if (y % S == 0 && cy > 0)
+                                dirty[grid.id(cx, cy - 1, cz)] = 1;
+                            if (y % S == S - 1 && cy + 1 < grid.chunks_y)
+                                dirty[grid.id(cx, cy + 1, cz)] = 1;
+                            if ((d & 1) && cz > 0)
+                                dirty[grid.id(cx, cy, cz - 1)] = 1;
+                            if ((d >> (S - 1)) && cz + 1 < grid.chunks_z)
+                                dirty[grid.id(cx, cy, cz + 1)] = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+Remesher::Remesher (const Board &board)
+    : grid(board)
+    , dirty(grid.count(), 0)
+{
+    mark_all();
+}
+
+void
+Remesher::mark_all ()
+{
+    queue.clear();
+    for (int id = 0; id < grid.count(); id++) {
+        dirty[id] = 1;
+        queue.push_back(id);
+    }
+}
+
+void
+Remesher::mark (const Board &before, const Board &after)
+{
+    std::vector<uint8_t> changed(grid.count(), 0);
+    changed_chunks(before, after, grid, changed);
+
+    for (int id = 0; id < grid.count(); id++) {
+        if (changed[id] && !dirty[id]) {
+            dirty[id] = 1;
+            queue.push_back(id);
+        }
+    }
+}
+
+void
+Remesher::mark_cell (int x, int y, int z)
+{
+    const int S = MESH_CHUNK;
+    int cx = x / S, cy = y / S, cz = z / S;
+    int ids[7];
+    int count = 0;
+
+    ids[count++] = grid.id(cx, cy, cz);
+    if (x % S == 0 && cx > 0)
+        ids[count++] = grid.id(cx - 1, cy, cz);
+    if (x % S == S - 1 && cx + 1 < grid.chunks_x)
+        ids[count++] = grid.id(cx + 1, cy, cz);
+    if (y % S == 0 && cy > 0)
+        ids[count++] = grid.id(cx, cy - 1, cz);
+    if (y % S == S - 1 && cy + 1 < grid.chunks_y)
+        ids[count++] = grid.id(cx, cy + 1, cz);
+    if (z % S == 0 && cz > 0)
+        ids[count++] = grid.id(cx, cy, cz - 1);
+    if (z % S == S - 1 && cz + 1 < grid.chunks_z)
+        ids[count++] = grid.id(cx, cy, cz + 1);
+
+    for (int i = 0; i < count; i++) {
+        if (!dirty[ids[i]]) {
+            dirty[ids[i]] = 1;
+            queue.push_back(ids[i]);
+        }
+    }
+}
+
+int
+Remesher::pending () const
+{
+    return queue.size();
+}
+
+void
+Remesher::rebuild (const Board &board, double budget,
+                   std::function<void(int, const std::vector<float>&)> upload)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    size_t done = 0;
+
+    while (done < queue.size()) {
+        int id = queue[done++];
+        int cx = id % grid.chunks_x;
+        int cy = (id / grid.chunks_x) % grid.chunks_y;
+        int cz = id / (grid.chunks_x * grid.chunks_y);
+
+        vertices.clear();
+        mesh_chunk(board, cx, cy, cz, vertices);
+        upload(id, vertices);
+        dirty[id] = 0;
+
+        if (std::chrono::duration<double, std::milli>(clock::now() - start)
+                .count() >= budget)
+            break;
+    }
+    queue.erase(queue.begin(), queue.begin() + done);
+}
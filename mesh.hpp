@@ -0,0 +1,77 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include "board.hpp"
+
+/* cells along each side of a mesh chunk */
+#define MESH_CHUNK 16
+
+/*
+ * The grid of mesh chunks covering a board.  Chunk cx, cy, cz holds the
+ * cells [cx * MESH_CHUNK, cx * MESH_CHUNK + MESH_CHUNK) along x and so on.
+ */
+struct MeshGrid {
+    int chunks_x;
+    int chunks_y;
+    int chunks_z;
+
+    MeshGrid (const Board &board);
+
+    int count () const;
+    int id (int cx, int cy, int cz) const;
+};
+
+/*
+ * Build the mesh of one chunk of a board.  Only faces of living cells which
+ * face a dead cell are kept, and faces in the same plane facing the same way
+ * are merged greedily into larger quads.  Vertices are appended to
+ * `vertices' as position (x, y, z) then normal (x, y, z), two triangles per
+ * quad, wound clockwise like the cube.
+ */
+void mesh_chunk (const Board &board, int cx, int cy, int cz,
+                 std::vector<float> &vertices);
+
+/*
+ * Mark in `dirty' (indexed by MeshGrid::id) every chunk whose mesh differs
+ * between boards `a' and `b': the chunks where a cell changed and the chunks
+ * across a face from a changed cell on their border.  Only board chunks
+ * flagged in either board are compared.
+ */
+void changed_chunks (const Board &a, const Board &b, const MeshGrid &grid,
+                     std::vector<uint8_t> &dirty);
+
+/*
+ * The chunks of a board whose meshes are out of date.  Chunks are marked as
+ * the shown board changes and rebuilt a few at a time within a budget, so
+ * that the cost of a frame follows how much of the board changed.
+ */
+class Remesher {
+public:
+    Remesher (const Board &board);
+
+    /* every chunk is out of date */
+    void mark_all ();
+
+    /* the shown board went from `before' to `after' */
+    void mark (const Board &before, const Board &after);
+
+    /* the cell at x, y, z of the shown board was set or killed */
+    void mark_cell (int x, int y, int z);
+
+    /* number of chunks waiting to be rebuilt */
+    int pending () const;
+
+    /*
+     * Rebuild waiting chunks from `board', giving each new mesh to
+     * upload(id, vertices), until `budget' milliseconds have passed.  At
+     * least one chunk is rebuilt per call.
+     */
+    void rebuild (const Board &board, double budget,
+                  std::function<void(int, const std::vector<float>&)> upload);
+
+protected:
+    MeshGrid grid;
+    std::vector<uint8_t> dirty;
+    std::vector<int> queue;
+    std::vector<float> vertices;
+};
@@ -1,5 +1,10 @@
-#include "draw.hpp"
+#pragma once
+#include "vecmath.hpp"
+#include <algorithm>
+#include <queue>
+#include <stdint.h>
 #include <vector>
+#include "pool.hpp"
 
 using namespace glm;
 
@@ -17,7 +22,7 @@ struct BoundingBox {
     { }
     
     bool
-    contains (vec3 pos)
+    contains (vec3 pos) const
     {
         /* offset because everything is +-0.5 */
         pos = pos + vec3(0.5, 0.5, 0.5);
@@ -25,42 +30,153 @@ struct BoundingBox {
                 all(greaterThanEqual(max, pos)));
     }
 
-};
+    vec3
+    center () const
+    {
+        return min + (max - min) / 2.f;
+    }
 
-struct Octant {
-    std::vector<BoundingBox> region;
-    Octant (BoundingBox bounds, vec3 center)
+    /*
+     * One of the 8 boxes splitting this one at its center.  Bit 0 of `i'
+     * picks the upper half along x, bit 1 along y and bit 2 along z.
+     */
+    BoundingBox
+    octant (int i) const
     {
-        region.resize(8);
-		region[0] = BoundingBox(bounds.min, center);
+        vec3 c = center();
+        return BoundingBox(vec3(i & 1 ? c.x : min.x,
+                                i & 2 ? c.y : min.y,
+                                i & 4 ? c.z : min.z),
+                           vec3(i & 1 ? max.x : c.x,
+                                i & 2 ? max.y : c.y,
+                                i & 4 ? max.z : c.z));
+    }
 
-		region[1] = BoundingBox(vec3(center.x, bounds.min.y, bounds.min.z), 
-                                vec3(bounds.max.x, center.y, center.z));
+    /* squared distance from an object to the nearest object the box holds */
+    float
+    distance2 (vec3 pos) const
+    {
+        pos = pos + vec3(0.5, 0.5, 0.5);
+        float d = 0;
+        for (int i = 0; i < 3; i++) {
+            float v = pos[i] < min[i] ? min[i] - pos[i]
+                    : pos[i] > max[i] ? pos[i] - max[i] : 0;
+            d += v * v;
+        }
+        return d;
+    }
 
-		region[2] = BoundingBox(vec3(center.x, bounds.min.y, center.z),
-                                vec3(bounds.max.x, center.y, bounds.max.z));
+    bool
+    intersects (const BoundingBox &other) const
+    {
+        return (all(greaterThanEqual(other.max, min)) &&
+                all(greaterThanEqual(max, other.min)));
+    }
 
-		region[3] = BoundingBox(vec3(bounds.min.x, bounds.min.y, center.z),
-                                vec3(center.x, center.y, bounds.max.z));
+    /* the octant an object inside of the box lies in */
+    int
+    octant_of (vec3 pos) const
+    {
+        vec3 c = center();
+        pos = pos + vec3(0.5, 0.5, 0.5);
+        return (pos.x > c.x) | (pos.y > c.y) << 1 | (pos.z > c.z) << 2;
+    }
+};
 
-		region[4] = BoundingBox(vec3(bounds.min.x, center.y, bounds.min.z),
-                                vec3(center.x, bounds.max.y, center.z));
+/*
+ * The six planes bounding what a camera can see, taken from its projection
+ * times view matrix.  Every plane's normal points into the frustum.
+ */
+struct Frustum {
+    enum { OUTSIDE, PARTIAL, INSIDE };
 
-		region[5] = BoundingBox(vec3(center.x, center.y, bounds.min.z),
-                                vec3(bounds.max.x, bounds.max.y, center.z));
+    vec4 planes[6];
 
-		region[6] = BoundingBox(center, bounds.max);
+    Frustum (mat4 m)
+    {
+        for (int i = 0; i < 3; i++) {
+            vec4 row(m[0][i], m[1][i], m[2][i], m[3][i]);
+            vec4 w(m[0][3], m[1][3], m[2][3], m[3][3]);
+            planes[i * 2] = w + row;
+            planes[i * 2 + 1] = w - row;
+        }
+    }
 
-		region[7] = BoundingBox(vec3(bounds.min.x, center.y, center.z),
-                                vec3(center.x, bounds.max.y, bounds.max.z));
+    /* whether a box in world space is outside, crossing or inside */
+    int
+    classify (vec3 min, vec3 max) const
+    {
+        int result = INSIDE;
+
+        for (int i = 0; i < 6; i++) {
+            const vec4 &p = planes[i];
+            /* the corners furthest along and against the plane's normal */
+            vec3 far(p.x > 0 ? max.x : min.x,
+                     p.y > 0 ? max.y : min.y,
+                     p.z > 0 ? max.z : min.z);
+            vec3 near(p.x > 0 ? min.x : max.x,
+                      p.y > 0 ? min.y : max.y,
+                      p.z > 0 ? min.z : max.z);
+
+            if (dot(vec3(p), far) + p.w < 0)
+                return OUTSIDE;
+            if (dot(vec3(p), near) + p.w < 0)
+                result = PARTIAL;
+        }
+        return result;
     }
 };
 
+/*
+ * A node of an Octree.  A node either has 8 children, which are the 8
+ * consecutive nodes from `child', or is a leaf holding its objects in bucket
+ * `bucket' of the tree, -1 while it is empty.  `count' is the number of
+ * objects in the subtree.
+ * The region of a node isn't stored; it is found on the way down from the
+ * root.
+ */
+struct OctreeNode {
+    int32_t child;
+    int32_t bucket;
+    int32_t count;
+
+    bool leaf () const { return child < 0; }
+};
+
+/*
+ * A linear octree.  Every node lives in one array and every leaf's objects
+ * in fixed buckets of LEAF_SIZE in another, so building and walking the tree
+ * makes no allocation per node and nodes are only 12 bytes.  Objects outside
+ * of the root's region, and any a leaf at MAX_DEPTH had no room for when the
+ * tree was built, are kept apart and always visited.
+ *
+ * Objects can be inserted, erased and moved in place.  A leaf is split when
+ * it overflows and a subtree is merged back into a leaf once it holds no
+ * more than MERGE_SIZE objects, so a change costs a walk down the tree and
+ * the nodes freed by merging are reused by later splits.
+ */
 class Octree {
 public:
+    /* objects a leaf holds before it is split */
+    static const int LEAF_SIZE = 8;
+    /*
+     * Leaves this deep are never split and keep at most LEAF_SIZE objects.
+     * Building puts the objects past that with those outside of the region,
+     * while insert() refuses them.
+     */
+    static const int MAX_DEPTH = 21;
+    /* subtrees holding this many objects or fewer are merged into a leaf */
+    static const int MERGE_SIZE = LEAF_SIZE / 2;
+    /* queries a thread takes at a time in a batch */
+    static const int QUERY_BATCH = 64;
+
     BoundingBox region;
-    std::vector<vec3> objects;
-    std::vector<Octree> children;
+    std::vector<OctreeNode> nodes;
+    std::vector<vec3> buckets;
+    std::vector<vec3> outside;
+    /* first nodes of unused groups of 8 and unused buckets */
+    std::vector<int32_t> free_nodes;
+    std::vector<int32_t> free_buckets;
 
     Octree ()
         : region(BoundingBox())
@@ -69,65 +185,673 @@ public:
     Octree (BoundingBox region, std::vector<vec3> &list)
         : region(region)
     {
-        vec3 dimensions = region.max - region.min; 
+        std::vector<vec3> objects;
+        objects.reserve(list.size());
+        for (auto &obj : list) {
+            if (region.contains(obj))
+                objects.push_back(obj);
+            else
+                outside.push_back(obj);
+        }
+
+        nodes.reserve(objects.size() / 2 + 1);
+        buckets.reserve(objects.size() * 2 + LEAF_SIZE);
+        nodes.push_back(OctreeNode());
+        build(0, region, objects.begin(), objects.end(), 0);
+    }
+
+    /* number of objects in the tree */
+    size_t
+    size () const
+    {
+        return nodes.empty() ? outside.size() : nodes[0].count + outside.size();
+    }
 
-        if (list.size() <= 8) {
-            objects = list;
-            return;
+    /*
+     * Add an object to the tree.  Returns false if the leaf it belongs to is
+     * full and can't be split any further.
+     */
+    bool
+    insert (vec3 obj)
+    {
+        if (nodes.empty() || !region.contains(obj)) {
+            outside.push_back(obj);
+            return true;
         }
 
-        vec3 half = dimensions / 2.f;
-        vec3 center = region.min + half;
+        int path[MAX_DEPTH + 1];
+        BoundingBox box;
+        int depth = descend(obj, path, box);
+        int n = path[depth];
 
-        Octant oct(region, center);
+        while (nodes[n].count == LEAF_SIZE) {
+            if (depth == MAX_DEPTH)
+                return false;
+            split(n, box);
+            int i = box.octant_of(obj);
+            box = box.octant(i);
+            n = path[++depth] = nodes[n].child + i;
+        }
 
-        std::vector<std::vector<vec3>> octlist(8);
-        bool contained;
+        if (nodes[n].bucket < 0)
+            nodes[n].bucket = new_bucket();
+        bucket(nodes[n].bucket)[nodes[n].count] = obj;
+        for (int i = 0; i <= depth; i++)
+            nodes[path[i]].count++;
+        return true;
+    }
 
-        for (auto &obj : list) {
-            contained = false;
-            for (int i = 0; i < 8; i++) {
-                if (oct.region[i].contains(obj)) {
-                    octlist[i].push_back(obj);
-                    contained = true;
-                    break;
+    /* Remove an object from the tree.  Returns false if it wasn't there. */
+    bool
+    erase (vec3 obj)
+    {
+        if (nodes.empty() || !region.contains(obj))
+            return erase_outside(obj);
+
+        int path[MAX_DEPTH + 1];
+        BoundingBox box;
+        int depth = descend(obj, path, box);
+        OctreeNode &leaf = nodes[path[depth]];
+
+        /* it may be one a full leaf at MAX_DEPTH left outside */
+        if (leaf.count == 0)
+            return erase_outside(obj);
+        vec3 *objs = bucket(leaf.bucket);
+        vec3 *it = std::find(objs, objs + leaf.count, obj);
+        if (it == objs + leaf.count)
+            return erase_outside(obj);
+        *it = objs[leaf.count - 1];
+
+        for (int i = 0; i <= depth; i++)
+            nodes[path[i]].count--;
+        if (leaf.count == 0) {
+            free_buckets.push_back(leaf.bucket);
+            leaf.bucket = -1;
+        }
+
+        /* merge the largest subtree on the way down which became small */
+        for (int i = 0; i < depth; i++) {
+            if (nodes[path[i]].count <= MERGE_SIZE) {
+                merge(path[i]);
+                break;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Move an object from `from' to `to'.  When both lie in the same leaf
+     * the object is only rewritten.  Returns false if it wasn't there or
+     * couldn't be inserted at `to'.
+     */
+    bool
+    move (vec3 from, vec3 to)
+    {
+        if (!nodes.empty() && region.contains(from) && region.contains(to)) {
+            int path[MAX_DEPTH + 1];
+            BoundingBox box;
+            int n = path[descend(from, path, box)];
+
+            if (n == path[descend(to, path, box)] && nodes[n].count > 0) {
+                vec3 *objs = bucket(nodes[n].bucket);
+                vec3 *it = std::find(objs, objs + nodes[n].count, from);
+                if (it != objs + nodes[n].count) {
+                    *it = to;
+                    return true;
                 }
             }
-            if (!contained) {
-                objects.push_back(obj);
+        }
+
+        return erase(from) && insert(to);
+    }
+
+    /*
+     * Apply a generation's changes: erase every object of `removed' and
+     * insert every object of `added'.  Returns the number of objects which
+     * couldn't be erased or inserted.
+     */
+    int
+    update (const std::vector<vec3> &removed, const std::vector<vec3> &added)
+    {
+        int failed = 0;
+        for (auto &obj : removed)
+            failed += !erase(obj);
+        for (auto &obj : added)
+            failed += !insert(obj);
+        return failed;
+    }
+
+    /* put every object inside of `box' into list */
+    void
+    query_box (const BoundingBox &box, std::vector<vec3> &list) const
+    {
+        for (auto &obj : outside)
+            if (box.contains(obj))
+                list.push_back(obj);
+        if (!nodes.empty())
+            query_box(0, region, box, list);
+    }
+
+    /* put every object no further than `radius' from `center' into list */
+    void
+    query_radius (vec3 center, float radius, std::vector<vec3> &list) const
+    {
+        float r2 = radius * radius;
+        for (auto &obj : outside)
+            if (distance2(obj, center) <= r2)
+                list.push_back(obj);
+        if (!nodes.empty())
+            query_radius(0, region, center, r2, list);
+    }
+
+    /*
+     * Put the k objects nearest to `point' into list, nearest first.  Nodes
+     * are visited nearest first and the search stops at the first node
+     * further away than the k-th object found so far.
+     */
+    void
+    nearest (vec3 point, int k, std::vector<vec3> &list) const
+    {
+        typedef std::pair<float, vec3> Found;
+        auto further = [](const Found &a, const Found &b) {
+            return a.first < b.first;
+        };
+        /* the k nearest so far, furthest on top */
+        std::priority_queue<Found, std::vector<Found>, decltype(further)>
+            found(further);
+        auto offer = [&](vec3 obj) {
+            float d = distance2(obj, point);
+            if ((int) found.size() < k) {
+                found.push(Found(d, obj));
+            }
+            else if (d < found.top().first) {
+                found.pop();
+                found.push(Found(d, obj));
+            }
+        };
+
+        if (k <= 0)
+            return;
+        for (auto &obj : outside)
+            offer(obj);
+
+        struct Pending {
+            float distance;
+            int node;
+            BoundingBox box;
+            bool operator< (const Pending &o) const
+            { return distance > o.distance; }
+        };
+        std::priority_queue<Pending> pending;
+        if (!nodes.empty())
+            pending.push(Pending { region.distance2(point), 0, region });
+
+        while (!pending.empty()) {
+            Pending p = pending.top();
+            pending.pop();
+            if ((int) found.size() == k && p.distance > found.top().first)
+                break;
+
+            const OctreeNode &node = nodes[p.node];
+            if (node.count == 0)
+                continue;
+            if (node.leaf()) {
+                const vec3 *objs = bucket(node.bucket);
+                for (int i = 0; i < node.count; i++)
+                    offer(objs[i]);
+                continue;
+            }
+            for (int i = 0; i < 8; i++) {
+                BoundingBox box = p.box.octant(i);
+                pending.push(Pending { box.distance2(point),
+                                       node.child + i, box });
             }
         }
 
-        children.resize(8);
-        for (int i = 0; i < 8; i++) {
-            children[i] = Octree(oct.region[i], octlist[i]);
+        size_t first = list.size();
+        list.resize(first + found.size());
+        for (size_t i = list.size(); i > first; i--) {
+            list[i - 1] = found.top().second;
+            found.pop();
         }
     }
 
+    /*
+     * The same queries for many boxes, points or centers at once, split
+     * across the threads of a pool.  results[i] holds the answer to the i-th
+     * query.
+     */
+    void
+    query_box (const std::vector<BoundingBox> &boxes,
+               std::vector<std::vector<vec3>> &results, ThreadPool &pool) const
+    {
+        batch(boxes.size(), results, pool,
+              [&](int i, std::vector<vec3> &list) {
+                  query_box(boxes[i], list);
+              });
+    }
+
+    void
+    query_radius (const std::vector<vec3> &centers, float radius,
+                  std::vector<std::vector<vec3>> &results,
+                  ThreadPool &pool) const
+    {
+        batch(centers.size(), results, pool,
+              [&](int i, std::vector<vec3> &list) {
+                  query_radius(centers[i], radius, list);
+              });
+    }
+
+    void
+    nearest (const std::vector<vec3> &points, int k,
+             std::vector<std::vector<vec3>> &results, ThreadPool &pool) const
+    {
+        batch(points.size(), results, pool,
+              [&](int i, std::vector<vec3> &list) {
+                  nearest(points[i], k, list);
+              });
+    }
+
     void
     print ()
     {
-        static int tab = 0;
+        if (!nodes.empty())
+            print(0, region, 0);
+    }
+
+    void
+    get (std::vector<vec3> &list)
+    {
+        if (!nodes.empty())
+            get(0, region, list);
+    }
+
+    /*
+     * Call f(obj) for every object of the tree that may be inside of the
+     * frustum.  Nodes are tested in world space, where an object at `pos'
+     * is the cube around it, and subtrees entirely outside of the frustum
+     * are skipped while subtrees entirely inside of it are not tested.
+     */
+    template <typename F>
+    void
+    visible (const Frustum &frustum, F f)
+    {
+        for (auto &obj : outside)
+            f(obj);
+        if (!nodes.empty())
+            visible(0, region, frustum, f, false);
+    }
+
+    /*
+     * Like visible, but a subtree whose box would be drawn less than
+     * `pixels' wide is given whole to box(min, max, occupancy) rather than
+     * its objects to f.  `min' and `max' are the corners of the box in
+     * world space and `occupancy' is the share of the box's cells holding
+     * an object.  A box is as wide on screen as its size times `scale' over
+     * its distance from `eye', where `scale' is the height of the screen in
+     * pixels over 2 tan(fov / 2), so the objects visited grow with what can
+     * be made out on screen rather than with the objects in the tree.
+     */
+    template <typename F, typename B>
+    void
+    visible_lod (const Frustum &frustum, vec3 eye, float scale, float pixels,
+                 F f, B box)
+    {
+        for (auto &obj : outside)
+            f(obj);
+        /* the eye as an object, since boxes measure distance to objects */
+        vec3 at = eye - vec3(0.5, 0.5, 0.5);
+        if (!nodes.empty())
+            visible_lod(0, region, frustum, at, scale * scale,
+                        pixels * pixels, f, box, false);
+    }
+
+protected:
+    typedef std::vector<vec3>::iterator iter;
+
+    /* objects of bucket b */
+    vec3 *
+    bucket (int b)
+    {
+        return &buckets[b * LEAF_SIZE];
+    }
+
+    const vec3 *
+    bucket (int b) const
+    {
+        return &buckets[b * LEAF_SIZE];
+    }
+
+    static float
+    distance2 (vec3 a, vec3 b)
+    {
+        vec3 d = a - b;
+        return d.x * d.x + d.y * d.y + d.z * d.z;
+    }
+
+    /* run query(i, results[i]) for count queries in groups across a pool */
+    template <typename Q>
+    void
+    batch (int count, std::vector<std::vector<vec3>> &results,
+           ThreadPool &pool, Q query) const
+    {
+        results.resize(count);
+        int groups = (count + QUERY_BATCH - 1) / QUERY_BATCH;
+        pool.run(groups, [&](int g) {
+            int end = std::min(g * QUERY_BATCH + QUERY_BATCH, count);
+            for (int i = g * QUERY_BATCH; i < end; i++) {
+                results[i].clear();
+                query(i, results[i]);
+            }
+        });
+    }
+
+    void
+    query_box (int n, const BoundingBox &node_box, const BoundingBox &box,
+               std::vector<vec3> &list) const
+    {
+        const OctreeNode &node = nodes[n];
+        if (node.count == 0 || !node_box.intersects(box))
+            return;
+
+        if (node.leaf()) {
+            const vec3 *objs = bucket(node.bucket);
+            for (int i = 0; i < node.count; i++)
+                if (box.contains(objs[i]))
+                    list.push_back(objs[i]);
+            return;
+        }
+        for (int i = 0; i < 8; i++)
+            query_box(node.child + i, node_box.octant(i), box, list);
+    }
+
+    void
+    query_radius (int n, const BoundingBox &box, vec3 center, float r2,
+                  std::vector<vec3> &list) const
+    {
+        const OctreeNode &node = nodes[n];
+        if (node.count == 0 || box.distance2(center) > r2)
+            return;
+
+        if (node.leaf()) {
+            const vec3 *objs = bucket(node.bucket);
+            for (int i = 0; i < node.count; i++)
+                if (distance2(objs[i], center) <= r2)
+                    list.push_back(objs[i]);
+            return;
+        }
+        for (int i = 0; i < 8; i++)
+            query_radius(node.child + i, box.octant(i), center, r2, list);
+    }
+
+    int
+    new_bucket ()
+    {
+        if (!free_buckets.empty()) {
+            int b = free_buckets.back();
+            free_buckets.pop_back();
+            return b;
+        }
+        buckets.resize(buckets.size() + LEAF_SIZE);
+        return buckets.size() / LEAF_SIZE - 1;
+    }
+
+    /* the first of a new group of 8 nodes */
+    int
+    new_nodes ()
+    {
+        if (!free_nodes.empty()) {
+            int n = free_nodes.back();
+            free_nodes.pop_back();
+            return n;
+        }
+        nodes.resize(nodes.size() + 8);
+        return nodes.size() - 8;
+    }
+
+    template <typename I>
+    void
+    make_leaf (int n, I begin, I end)
+    {
+        nodes[n].child = -1;
+        nodes[n].bucket = begin == end ? -1 : new_bucket();
+        nodes[n].count = end - begin;
+        if (begin != end)
+            std::copy(begin, end, bucket(nodes[n].bucket));
+    }
+
+    /*
+     * Walk down to the leaf whose region holds `obj', which must be inside
+     * of the tree's region.  The nodes on the way are put in `path' and the
+     * leaf's region in `box'.  Returns the depth of the leaf.
+     */
+    int
+    descend (vec3 obj, int *path, BoundingBox &box)
+    {
+        int depth = 0;
+        int n = path[0] = 0;
+        box = region;
+
+        while (!nodes[n].leaf()) {
+            int i = box.octant_of(obj);
+            box = box.octant(i);
+            n = path[++depth] = nodes[n].child + i;
+        }
+        return depth;
+    }
+
+    /* turn the full leaf n into 8 leaves holding its objects */
+    void
+    split (int n, const BoundingBox &box)
+    {
+        vec3 objs[LEAF_SIZE];
+        int count = nodes[n].count;
+        std::copy(bucket(nodes[n].bucket), bucket(nodes[n].bucket) + count,
+                  objs);
+        free_buckets.push_back(nodes[n].bucket);
+
+        int child = new_nodes();
+        nodes[n].child = child;
+        nodes[n].bucket = -1;
+        for (int i = 0; i < 8; i++) {
+            nodes[child + i].child = -1;
+            nodes[child + i].bucket = -1;
+            nodes[child + i].count = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            OctreeNode &leaf = nodes[child + box.octant_of(objs[i])];
+            if (leaf.bucket < 0)
+                leaf.bucket = new_bucket();
+            bucket(leaf.bucket)[leaf.count++] = objs[i];
+        }
+    }
+
+    /* copy the objects of the subtree at n into objs */
+    void
+    gather (int n, vec3 *objs, int &count)
+    {
+        if (nodes[n].leaf()) {
+            for (int i = 0; i < nodes[n].count; i++)
+                objs[count++] = bucket(nodes[n].bucket)[i];
+            return;
+        }
+        for (int i = 0; i < 8; i++)
+            gather(nodes[n].child + i, objs, count);
+    }
+
+    /* remove an object from those kept outside of the tree */
+    bool
+    erase_outside (vec3 obj)
+    {
+        auto it = std::find(outside.begin(), outside.end(), obj);
+        if (it == outside.end())
+            return false;
+        *it = outside.back();
+        outside.pop_back();
+        return true;
+    }
+
+    /* give back the nodes and buckets of the subtree at n */
+    void
+    release (int n)
+    {
+        if (nodes[n].leaf()) {
+            if (nodes[n].bucket >= 0)
+                free_buckets.push_back(nodes[n].bucket);
+            return;
+        }
+        for (int i = 0; i < 8; i++)
+            release(nodes[n].child + i);
+        free_nodes.push_back(nodes[n].child);
+    }
+
+    /* turn the subtree at n, holding no more than LEAF_SIZE, into a leaf */
+    void
+    merge (int n)
+    {
+        vec3 objs[LEAF_SIZE];
+        int count = 0;
+        gather(n, objs, count);
+        release(n);
+        make_leaf(n, objs, objs + count);
+    }
+
+    /*
+     * Build node n over the objects [begin, end), partitioning them in place
+     * into the 8 octants rather than copying them into a list per octant.
+     */
+    void
+    build (int n, const BoundingBox &box, iter begin, iter end, int depth)
+    {
+        if (end - begin <= LEAF_SIZE || depth == MAX_DEPTH) {
+            /* a leaf which can't be split keeps the rest outside */
+            if (end - begin > LEAF_SIZE) {
+                outside.insert(outside.end(), begin + LEAF_SIZE, end);
+                end = begin + LEAF_SIZE;
+            }
+            make_leaf(n, begin, end);
+            return;
+        }
+
+        vec3 c = box.center();
+        iter split[9];
+        split[0] = begin;
+        split[8] = end;
+        split[4] = std::partition(begin, end,
+                [&](const vec3 &p) { return p.z + 0.5f <= c.z; });
+        for (int i = 0; i < 8; i += 4) {
+            split[i + 2] = std::partition(split[i], split[i + 4],
+                    [&](const vec3 &p) { return p.y + 0.5f <= c.y; });
+        }
+        for (int i = 0; i < 8; i += 2) {
+            split[i + 1] = std::partition(split[i], split[i + 2],
+                    [&](const vec3 &p) { return p.x + 0.5f <= c.x; });
+        }
+
+        int child = nodes.size();
+        nodes.resize(child + 8);
+        nodes[n].child = child;
+        nodes[n].bucket = -1;
+        nodes[n].count = 0;
+
+        for (int i = 0; i < 8; i++) {
+            build(child + i, box.octant(i), split[i], split[i + 1], depth + 1);
+            nodes[n].count += nodes[child + i].count;
+        }
+    }
+
+    void
+    print (int n, const BoundingBox &box, int tab)
+    {
         for (int i = 0; i < tab; i++)
             printf("  ");
 
-        printf("(%f, %f, %f) -> (%f, %f, %f) | %lu\n",
-                region.min.x, region.min.y, region.min.z,
-                region.max.x, region.max.y, region.max.z,
-                objects.size());
+        printf("(%f, %f, %f) -> (%f, %f, %f) | %d\n",
+                box.min.x, box.min.y, box.min.z,
+                box.max.x, box.max.y, box.max.z,
+                nodes[n].leaf() ? nodes[n].count : 0);
 
-        tab++;
-        for (unsigned i = 0; i < children.size(); i++)
-            children[i].print();
-        tab--;
+        if (!nodes[n].leaf())
+            for (int i = 0; i < 8; i++)
+                print(nodes[n].child + i, box.octant(i), tab + 1);
     }
 
     void
-    get (std::vector<vec3> &list)
+    get (int n, const BoundingBox &box, std::vector<vec3> &list)
+    {
+        list.push_back(box.max - box.min);
+
+        if (!nodes[n].leaf())
+            for (int i = 0; i < 8; i++)
+                get(nodes[n].child + i, box.octant(i), list);
+    }
+
+    template <typename F>
+    void
+    visible (int n, const BoundingBox &box, const Frustum &frustum, F &f,
+             bool inside)
+    {
+        const OctreeNode &node = nodes[n];
+        if (node.count == 0)
+            return;
+
+        if (!inside) {
+            vec3 offset(0.5, 0.5, 0.5);
+            int side = frustum.classify(box.min - offset, box.max - offset);
+            if (side == Frustum::OUTSIDE)
+                return;
+            inside = side == Frustum::INSIDE;
+        }
+
+        if (node.leaf()) {
+            vec3 *objs = bucket(node.bucket);
+            for (int i = 0; i < node.count; i++)
+                f(objs[i]);
+            return;
+        }
+
+        for (int i = 0; i < 8; i++)
+            visible(node.child + i, box.octant(i), frustum, f, inside);
+    }
+
+    template <typename F, typename B>
+    void
+    visible_lod (int n, const BoundingBox &box, const Frustum &frustum,
+                 vec3 eye, float scale2, float pixels2, F &f, B &lod,
+                 bool inside)
     {
-        list.push_back(region.max - region.min);
+        const OctreeNode &node = nodes[n];
+        if (node.count == 0)
+            return;
+
+        vec3 offset(0.5, 0.5, 0.5);
+        if (!inside) {
+            int side = frustum.classify(box.min - offset, box.max - offset);
+            if (side == Frustum::OUTSIDE)
+                return;
+            inside = side == Frustum::INSIDE;
+        }
+
+        /* compared squared, the width on screen is size * scale / distance */
+        vec3 size = box.max - box.min;
+        float width = std::max(size.x, std::max(size.y, size.z));
+        if (width > 1 &&
+            width * width * scale2 < pixels2 * box.distance2(eye)) {
+            float occupancy = node.count / (size.x * size.y * size.z);
+            lod(box.min - offset, box.max - offset, std::min(occupancy, 1.0f));
+            return;
+        }
+
+        if (node.leaf()) {
+            vec3 *objs = bucket(node.bucket);
+            for (int i = 0; i < node.count; i++)
+                f(objs[i]);
+            return;
+        }
 
-        for (unsigned i = 0; i < children.size(); i++)
-            children[i].get(list);
+        for (int i = 0; i < 8; i++)
+            visible_lod(node.child + i, box.octant(i), frustum, eye, scale2,
+                        pixels2, f, lod, inside);
     }
 };
@@ -0,0 +1,80 @@
+#include "pool.hpp"
+
+ThreadPool::ThreadPool (int threads)
+    : count(0)
+    , next_job(0)
+    , active(0)
+    , batch(0)
+    , quit(false)
+{
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool ()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+int
+ThreadPool::size ()
+{
+    return workers.size() + 1;
+}
+
+void
+ThreadPool::take_jobs ()
+{
+    int i;
+    while ((i = next_job.fetch_add(1)) < count)
+        job(i);
+}
+
+void
+ThreadPool::run (int count, std::function<void(int)> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        this->job = job;
+        this->count = count;
+        this->next_job = 0;
+        this->active = workers.size();
+        this->batch++;
+    }
+    wake.notify_all();
+
+    take_jobs();
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return active == 0; });
+}
+
+void
+ThreadPool::work ()
+{
+    unsigned long seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return quit || batch != seen; });
+            if (quit)
+                return;
+            seen = batch;
+        }
+
+        take_jobs();
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--active == 0)
+            done.notify_one();
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads which run batches of numbered jobs.  The
+ * thread calling run() works on the batch too and returns once every job of
+ * the batch has finished.
+ */
+class ThreadPool {
+public:
+    /* zero threads means one per hardware thread */
+    ThreadPool (int threads);
+    ~ThreadPool ();
+
+    /* number of threads working on a batch, counting the caller */
+    int size ();
+
+    /* call job(i) for every i in [0, count) */
+    void run (int count, std::function<void(int)> job);
+
+protected:
+    void work ();
+    void take_jobs ();
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    std::function<void(int)> job;
+    int count;
+    std::atomic<int> next_job;
+    int active;
+    unsigned long batch;
+    bool quit;
+};
@@ -0,0 +1,172 @@
+#include <cstdio>
+#include <cstring>
+#include "profile.hpp"
+
+Profiler profiler;
+
+static const char *phase_names[PHASES] = {
+    "frame", "input", "collect", "uniforms", "draw", "swap", "gpu", "step"
+};
+
+const char *
+phase_name (int phase)
+{
+    return phase_names[phase];
+}
+
+/* the track of the trace a phase is drawn on */
+enum { TRACK_MAIN = 1, TRACK_SIMULATION, TRACK_GPU };
+
+static int
+phase_track (int phase)
+{
+    if (phase == PHASE_STEP)
+        return TRACK_SIMULATION;
+    if (phase == PHASE_GPU)
+        return TRACK_GPU;
+    return TRACK_MAIN;
+}
+
+Profiler::Profiler ()
+    : epoch(std::chrono::steady_clock::now())
+    , keeping(false)
+    , next(0)
+    , window_start(0)
+{
+    memset(total, 0, sizeof(total));
+    memset(count, 0, sizeof(count));
+    memset(mean_ms, 0, sizeof(mean_ms));
+    memset(per_second, 0, sizeof(per_second));
+}
+
+uint64_t
+Profiler::now () const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+}
+
+void
+Profiler::add (int phase, uint64_t start, uint64_t duration)
+{
+    std::lock_guard<std::mutex> hold(lock);
+
+    roll(start + duration);
+    total[phase] += duration;
+    count[phase]++;
+
+    if (!keeping)
+        return;
+    Timing t = { phase, start, duration };
+    if (timings.size() < PROFILE_EVENTS) {
+        timings.push_back(t);
+    }
+    else {
+        timings[next] = t;
+        next = (next + 1) % PROFILE_EVENTS;
+    }
+}
+
+/* start a new window once the last one is over, keeping its means */
+void
+Profiler::roll (uint64_t time)
+{
+    uint64_t length = time - window_start;
+    if (time < window_start || length < PROFILE_WINDOW * 1000000ULL)
+        return;
+
+    for (int p = 0; p < PHASES; p++) {
+        mean_ms[p] = count[p] ? total[p] / 1e6 / count[p] : 0;
+        per_second[p] = count[p] * 1e9 / length;
+        total[p] = 0;
+        count[p] = 0;
+    }
+    window_start = time;
+}
+
+void
+Profiler::keep (bool keep)
+{
+    std::lock_guard<std::mutex> hold(lock);
+    keeping = keep;
+}
+
+std::string
+Profiler::summary ()
+{
+    std::lock_guard<std::mutex> hold(lock);
+    std::string text;
+    char part[64];
+
+    roll(now());
+    for (int p = 0; p < PHASES; p++) {
+        if (per_second[p] == 0)
+            continue;
+        /* the frame and the step run at rates of their own */
+        if (p == PHASE_FRAME || p == PHASE_STEP)
+            snprintf(part, sizeof(part), "%s %.2f ms (%.0f/s)  ",
+                     phase_names[p], mean_ms[p], per_second[p]);
+        else
+            snprintf(part, sizeof(part), "%s %.2f  ",
+                     phase_names[p], mean_ms[p]);
+        text += part;
+    }
+    if (!text.empty())
+        text.resize(text.size() - 2);
+    return text;
+}
+
+std::vector<double>
+Profiler::means ()
+{
+    std::lock_guard<std::mutex> hold(lock);
+
+    roll(now());
+    return std::vector<double>(mean_ms, mean_ms + PHASES);
+}
+
+bool
+Profiler::write_csv (const char *path)
+{
+    std::lock_guard<std::mutex> hold(lock);
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "phase,start_us,duration_us\n");
+    for (size_t i = 0; i < timings.size(); i++) {
+        const Timing &t = timings[(next + i) % timings.size()];
+        fprintf(file, "%s,%.3f,%.3f\n", phase_names[t.phase],
+                t.start / 1e3, t.duration / 1e3);
+    }
+    return fclose(file) == 0;
+}
+
+/*
+ * The Trace Event Format: a complete ("X") event for every timing, and the
+ * names of the tracks as metadata.
+ */
+bool
+Profiler::write_trace (const char *path)
+{
+    static const char *tracks[] = { NULL, "main", "simulation", "gpu" };
+    std::lock_guard<std::mutex> hold(lock);
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\"traceEvents\":[");
+    for (int track = TRACK_MAIN; track <= TRACK_GPU; track++)
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                      track == TRACK_MAIN ? "" : ",", track, tracks[track]);
+    for (size_t i = 0; i < timings.size(); i++) {
+        const Timing &t = timings[(next + i) % timings.size()];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                      "\"ts\":%.3f,\"dur\":%.3f}",
+                      phase_names[t.phase], phase_track(t.phase),
+                      t.start / 1e3, t.duration / 1e3);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
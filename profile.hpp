@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* the most timings kept for export, the oldest are dropped past it */
+#define PROFILE_EVENTS (1 << 20)
+/* milliseconds the means shown in the stats are taken over */
+#define PROFILE_WINDOW 500
+
+/* the parts of a frame and of a step which are timed */
+enum Phase {
+    PHASE_FRAME,
+    PHASE_INPUT,
+    PHASE_COLLECT,
+    PHASE_UNIFORMS,
+    PHASE_DRAW,
+    PHASE_SWAP,
+    /* the time the GPU took to draw a frame, from a timer query */
+    PHASE_GPU,
+    PHASE_STEP,
+    PHASES
+};
+
+/* a phase which ran from `start' for `duration', in nanoseconds */
+struct Timing {
+    int phase;
+    uint64_t start;
+    uint64_t duration;
+};
+
+/*
+ * Collects how long each phase takes, from any thread.  The mean of every
+ * phase over the last PROFILE_WINDOW milliseconds is kept for showing while
+ * running, and when asked to the timings themselves are kept to be written
+ * out afterwards, either as CSV or as a Chrome trace (chrome://tracing or
+ * Perfetto) with a track for drawing, stepping and the GPU each.
+ */
+class Profiler {
+public:
+    Profiler ();
+
+    /* nanoseconds since the profiler was made */
+    uint64_t now () const;
+
+    void add (int phase, uint64_t start, uint64_t duration);
+
+    /* keep every timing from now on to write out */
+    void keep (bool keep);
+
+    /* a line of the mean milliseconds of each phase and how often it ran */
+    std::string summary ();
+
+    /* the mean milliseconds of every phase, 0 for those which didn't run */
+    std::vector<double> means ();
+
+    /* write the kept timings, returning false if the file can't be */
+    bool write_csv (const char *path);
+    bool write_trace (const char *path);
+
+protected:
+    void roll (uint64_t time);
+
+    std::chrono::steady_clock::time_point epoch;
+    std::mutex lock;
+
+    bool keeping;
+    std::vector<Timing> timings;
+    /* where the next timing goes once the ring of timings is full */
+    size_t next;
+
+    /* totals since the window began, and the means of the last one */
+    uint64_t window_start;
+    uint64_t total[PHASES];
+    unsigned long count[PHASES];
+    double mean_ms[PHASES];
+    double per_second[PHASES];
+};
+
+/* the profiler every phase is timed into */
+extern Profiler profiler;
+
+/* time a phase from here to the end of the scope */
+class ScopedTimer {
+public:
+    ScopedTimer (int phase)
+        : phase(phase)
+        , start(profiler.now())
+    { }
+
+    ~ScopedTimer ()
+    {
+        profiler.add(phase, start, profiler.now() - start);
+    }
+
+protected:
+    int phase;
+    uint64_t start;
+};
+
+/* the name of a phase */
+const char *phase_name (int phase);
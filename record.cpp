@@ -0,0 +1,431 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "record.hpp"
+
+#define RECORD_MAGIC   "MODELREC"
+#define RECORD_VERSION 1
+
+enum { KEYFRAME, DELTA };
+
+/* the index of a word in a delta */
+static uint32_t
+word_index (const Board &board, int x, int y, int w, int layer)
+{
+    return (((size_t)layer * board.zwords + w) * board.size_x + x) *
+           board.size_y + y;
+}
+
+/* bytes up to the next multiple of 8, so every word stays aligned */
+static size_t
+align8 (size_t bytes)
+{
+    return (bytes + 7) & ~(size_t)7;
+}
+
+Recorder::Recorder (const char *path, const Board &first, const Rule &rule,
+                    uint64_t seed, int interval)
+    : path(path)
+    , last(first)
+    , offset(0)
+{
+    std::string text = format_rule(rule);
+    size_t words = (size_t)first.layers * first.layer_words;
+
+    if (words > UINT32_MAX) {
+        fprintf(stderr, "A %dx%dx%d board is too large to record\n",
+                first.size_x, first.size_y, first.size_z);
+        exit(1);
+    }
+    if (interval < 1) {
+        fprintf(stderr, "Keyframes must be at least 1 generation apart, "
+                        "not %d\n", interval);
+        exit(1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = RECORD_VERSION;
+    header.size_x = first.size_x;
+    header.size_y = first.size_y;
+    header.size_z = first.size_z;
+    header.layers = first.layers;
+    header.interval = interval;
+    header.seed = seed;
+    strncpy(header.rule, text.c_str(), sizeof(header.rule) - 1);
+
+    file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    /* frames are small and many, let them pile up before writing */
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    write(&header, sizeof(header));
+    record(first);
+}
+
+Recorder::~Recorder ()
+{
+    RecordTrailer trailer;
+    trailer.index = offset;
+    trailer.frames = offsets.size();
+    memcpy(trailer.magic, RECORD_MAGIC, sizeof(trailer.magic));
+
+    write(offsets.data(), offsets.size() * sizeof(uint64_t));
+    write(&trailer, sizeof(trailer));
+    if (fclose(file) != 0)
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+}
+
+unsigned long
+Recorder::frames () const
+{
+    return offsets.size();
+}
+
+void
+Recorder::write (const void *data, size_t bytes)
+{
+    if (fwrite(data, 1, bytes, file) != bytes) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    offset += bytes;
+}
+
+void
+Recorder::record (const Board &board)
+{
+    FrameHeader frame;
+    frame.generation = offsets.size();
+    offsets.push_back(offset);
+    payload.clear();
+
+    if (frame.generation % header.interval == 0) {
+        frame.type = KEYFRAME;
+        frame.count = keyframe(board);
+    }
+    else {
+        frame.type = DELTA;
+        frame.count = delta(board);
+    }
+    frame.bytes = payload.size();
+    write(&frame, sizeof(frame));
+    write(payload.data(), payload.size());
+}
+
+/*
+ * A bit for every chunk holding a cell which isn't dead, then the words of
+ * those chunks: layer by layer, row by row.
+ */
+uint32_t
+Recorder::keyframe (const Board &board)
+{
+    size_t nchunks = (size_t)board.zwords * board.chunks_x * board.chunks_y;
+    std::vector<uint64_t> words((nchunks + 63) / 64);
+    std::vector<uint64_t> cells;
+    uint32_t count = 0;
+
+    for (int w = 0; w < board.zwords; w++) {
+        for (int cx = 0; cx < board.chunks_x; cx++) {
+            for (int cy = 0; cy < board.chunks_y; cy++) {
+                if (!board.chunk_at(cx, cy, w))
+                    continue;
+
+                size_t start = cells.size();
+                uint64_t any = 0;
+                int x1 = std::min(cx * CHUNK + CHUNK, board.size_x);
+                int y1 = std::min(cy * CHUNK + CHUNK, board.size_y);
+                for (int l = 0; l < board.layers; l++) {
+                    for (int x = cx * CHUNK; x < x1; x++) {
+                        for (int y = cy * CHUNK; y < y1; y++) {
+                            uint64_t bits = *board.row(x, y, w, l);
+                            cells.push_back(bits);
+                            any |= bits;
+                        }
+                    }
+                }
+
+                /* flagged chunks which have since died are left out */
+                if (!any) {
+                    cells.resize(start);
+                    continue;
+                }
+                size_t i = ((size_t)w * board.chunks_x + cx) *
+                    board.chunks_y + cy;
+                words[i / 64] |= 1ULL << (i % 64);
+                count++;
+            }
+        }
+    }
+
+    words.insert(words.end(), cells.begin(), cells.end());
+    payload.resize(words.size() * sizeof(uint64_t));
+    memcpy(payload.data(), words.data(), payload.size());
+    last.copy(board);
+    return count;
+}
+
+/*
+ * The index of every word which changed since the last generation, padded
+ * to a multiple of 8 bytes, then the bits of each which flipped.  The last
+ * generation is brought up to this one as the changes are found.
+ */
+uint32_t
+Recorder::delta (const Board &board)
+{
+    std::vector<uint32_t> index;
+    std::vector<uint64_t> flipped;
+
+    for (int w = 0; w < board.zwords; w++) {
+        for (int cx = 0; cx < board.chunks_x; cx++) {
+            for (int cy = 0; cy < board.chunks_y; cy++) {
+                uint8_t &flag = last.chunk(cx * CHUNK, cy * CHUNK, w);
+                if (!flag && !board.chunk_at(cx, cy, w))
+                    continue;
+
+                int x1 = std::min(cx * CHUNK + CHUNK, board.size_x);
+                int y1 = std::min(cy * CHUNK + CHUNK, board.size_y);
+                for (int l = 0; l < board.layers; l++) {
+                    for (int x = cx * CHUNK; x < x1; x++) {
+                        for (int y = cy * CHUNK; y < y1; y++) {
+                            uint64_t now = *board.row(x, y, w, l);
+                            uint64_t &was = *last.row(x, y, w, l);
+                            if (now == was)
+                                continue;
+                            index.push_back(word_index(board, x, y, w, l));
+                            flipped.push_back(now ^ was);
+                            was = now;
+                        }
+                    }
+                }
+
+                /* the chunk now holds just what it does on the board */
+                flag = board.chunk_at(cx, cy, w);
+            }
+        }
+    }
+
+    size_t index_bytes = align8(index.size() * sizeof(uint32_t));
+    payload.assign(index_bytes + flipped.size() * sizeof(uint64_t), 0);
+    memcpy(payload.data(), index.data(), index.size() * sizeof(uint32_t));
+    memcpy(payload.data() + index_bytes, flipped.data(),
+           flipped.size() * sizeof(uint64_t));
+    return index.size();
+}
+
+Replay::Replay (const char *path)
+    : path(path)
+    , cache(1, 1, 1)
+    , cached(ULONG_MAX)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    void *map;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    length = st.st_size;
+    if (length < sizeof(RecordHeader)) {
+        fprintf(stderr, "%s is not a recording\n", path);
+        exit(1);
+    }
+    map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    data = (const uint8_t *) map;
+
+    const RecordHeader &h = header();
+    if (memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != RECORD_VERSION || h.interval == 0 ||
+        h.size_x <= 0 || h.size_y <= 0 || h.size_z <= 0 ||
+        h.layers != rule().layers())
+        invalid();
+
+    /*
+     * Take the index from the end of the file if it is whole, or walk the
+     * frames of a recording which was cut short.
+     */
+    const RecordTrailer *trailer =
+        (const RecordTrailer *) (data + length - sizeof(RecordTrailer));
+    if (length >= sizeof(RecordHeader) + sizeof(RecordTrailer) &&
+        memcmp(trailer->magic, RECORD_MAGIC, sizeof(trailer->magic)) == 0) {
+        size_t end = length - sizeof(RecordTrailer);
+        if (trailer->index < sizeof(RecordHeader) || trailer->index > end ||
+            trailer->index % 8 ||
+            trailer->frames != (end - trailer->index) / sizeof(uint64_t) ||
+            (end - trailer->index) % sizeof(uint64_t))
+            invalid();
+        const uint64_t *index = (const uint64_t *) (data + trailer->index);
+        offsets.assign(index, index + trailer->frames);
+
+        /* every frame, header and payload, must lie before the index */
+        for (uint64_t off : offsets) {
+            if (off < sizeof(RecordHeader) || off % 8 ||
+                off > trailer->index - sizeof(FrameHeader))
+                invalid();
+            const FrameHeader *frame = (const FrameHeader *) (data + off);
+            if (frame->bytes > trailer->index - off - sizeof(FrameHeader))
+                invalid();
+        }
+    }
+    else {
+        uint64_t off = sizeof(RecordHeader);
+        while (off + sizeof(FrameHeader) <= length) {
+            const FrameHeader *frame = (const FrameHeader *) (data + off);
+            if (frame->bytes > length - off - sizeof(FrameHeader))
+                break;
+            offsets.push_back(off);
+            off += sizeof(FrameHeader) + frame->bytes;
+        }
+        fprintf(stderr, "%s has no index, %zu generations found\n",
+                path, offsets.size());
+    }
+
+    if (offsets.empty()) {
+        fprintf(stderr, "%s holds no generations\n", path);
+        exit(1);
+    }
+    cache = Board(h.size_x, h.size_y, h.size_z, h.layers);
+}
+
+/* give up on a file which doesn't hold what a recording does */
+void
+Replay::invalid () const
+{
+    fprintf(stderr, "%s is not a recording\n", path);
+    exit(1);
+}
+
+Replay::~Replay ()
+{
+    munmap((void *) data, length);
+}
+
+const RecordHeader &
+Replay::header () const
+{
+    return *(const RecordHeader *) data;
+}
+
+Rule
+Replay::rule () const
+{
+    Rule rule;
+    char text[sizeof(RecordHeader::rule) + 1] = { 0 };
+
+    memcpy(text, header().rule, sizeof(RecordHeader::rule));
+    if (!parse_rule(text, rule)) {
+        fprintf(stderr, "%s has an unknown rule: %s\n", path, text);
+        exit(1);
+    }
+    return rule;
+}
+
+unsigned long
+Replay::frames () const
+{
+    return offsets.size();
+}
+
+const FrameHeader *
+Replay::frame_at (unsigned long frame) const
+{
+    return (const FrameHeader *) (data + offsets[frame]);
+}
+
+void
+Replay::load (unsigned long frame, Board &board)
+{
+    frame = std::min(frame, frames() - 1);
+    unsigned long key = frame - frame % header().interval;
+
+    /* start over from the keyframe unless the deltas lead on from here */
+    if (cached == ULONG_MAX || cached > frame || cached < key) {
+        const FrameHeader *f = frame_at(key);
+        if (f->type != KEYFRAME) {
+            fprintf(stderr, "%s: generation %lu is not a keyframe\n",
+                    path, key);
+            exit(1);
+        }
+
+        const uint64_t *chunks = (const uint64_t *) (f + 1);
+        size_t nchunks = (size_t)cache.zwords * cache.chunks_x * cache.chunks_y;
+        const uint64_t *cells = chunks + (nchunks + 63) / 64;
+        const uint64_t *end = chunks + f->bytes / sizeof(uint64_t);
+        if (cells > end)
+            invalid();
+
+        cache.clear_chunks();
+        for (size_t i = 0; i < nchunks; i++) {
+            if (!(chunks[i / 64] >> (i % 64) & 1))
+                continue;
+
+            int cy = i % cache.chunks_y;
+            int cx = i / cache.chunks_y % cache.chunks_x;
+            int w = i / cache.chunks_y / cache.chunks_x;
+            int x1 = std::min(cx * CHUNK + CHUNK, cache.size_x);
+            int y1 = std::min(cy * CHUNK + CHUNK, cache.size_y);
+            size_t words = (size_t)cache.layers * (x1 - cx * CHUNK) *
+                           (y1 - cy * CHUNK);
+            if (words > (size_t)(end - cells))
+                invalid();
+            for (int l = 0; l < cache.layers; l++)
+                for (int x = cx * CHUNK; x < x1; x++)
+                    for (int y = cy * CHUNK; y < y1; y++)
+                        *cache.row(x, y, w, l) = *cells++;
+            cache.chunk(cx * CHUNK, cy * CHUNK, w) = 1;
+        }
+        cached = key;
+    }
+
+    while (cached < frame)
+        apply(++cached);
+    board.copy(cache);
+}
+
+/* bring the cached generation up to `frame' by its delta */
+void
+Replay::apply (unsigned long frame)
+{
+    const FrameHeader *f = frame_at(frame);
+    if (f->type != DELTA) {
+        fprintf(stderr, "%s: generation %lu is not a delta\n", path, frame);
+        exit(1);
+    }
+
+    size_t index_bytes = align8((size_t)f->count * sizeof(uint32_t));
+    if (f->bytes < index_bytes + (size_t)f->count * sizeof(uint64_t))
+        invalid();
+
+    const uint32_t *index = (const uint32_t *) (f + 1);
+    const uint64_t *flipped = (const uint64_t *)
+        ((const uint8_t *) index + index_bytes);
+
+    for (uint32_t i = 0; i < f->count; i++) {
+        uint32_t n = index[i];
+        int y = n % cache.size_y;
+        n /= cache.size_y;
+        int x = n % cache.size_x;
+        n /= cache.size_x;
+        int w = n % cache.zwords;
+        int l = n / cache.zwords;
+        if (l >= cache.layers)
+            invalid();
+
+        *cache.row(x, y, w, l) ^= flipped[i];
+        cache.chunk(x, y, w) = 1;
+    }
+}
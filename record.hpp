@@ -0,0 +1,128 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "board.hpp"
+#include "rule.hpp"
+
+/* generations between two keyframes of a recording */
+#define KEYFRAME_INTERVAL 64
+
+/*
+ * A recording is a header, one frame per generation and an index:
+ *
+ *     RecordHeader
+ *     FrameHeader, payload     generation 0, always a keyframe
+ *     FrameHeader, payload     generation 1
+ *     ...
+ *     uint64_t offsets[frames] where each frame starts
+ *     RecordTrailer
+ *
+ * Every `interval' generations the frame is a keyframe: a bit per chunk
+ * telling which chunks follow, then the words of each of those chunks,
+ * layer by layer.  Other frames are deltas from the generation before: the
+ * index of each word which changed and its bits which flipped.  A frame is
+ * found in the index without reading the ones before it, and a generation
+ * is decoded from the keyframe before it and at most interval - 1 deltas.
+ *
+ * Numbers are written in the byte order of the machine.
+ */
+struct RecordHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t size_x;
+    int32_t size_y;
+    int32_t size_z;
+    int32_t layers;
+    uint32_t interval;
+    uint64_t seed;
+    /* the rule as format_rule writes it */
+    char rule[64];
+};
+
+struct FrameHeader {
+    uint32_t type;
+    /* chunks of a keyframe or words of a delta */
+    uint32_t count;
+    uint64_t generation;
+    /* bytes of the payload after this header */
+    uint64_t bytes;
+};
+
+struct RecordTrailer {
+    uint64_t index;
+    uint64_t frames;
+    char magic[8];
+};
+
+/*
+ * Write a recording as the board is stepped.  Frames are streamed to the
+ * file as they are recorded, keeping only the last generation in memory to
+ * find the next delta from.  The index is written when the recorder is
+ * destroyed.
+ */
+class Recorder {
+public:
+    Recorder (const char *path, const Board &first, const Rule &rule,
+              uint64_t seed, int interval = KEYFRAME_INTERVAL);
+    ~Recorder ();
+
+    /* add the next generation */
+    void record (const Board &board);
+
+    /* number of generations recorded */
+    unsigned long frames () const;
+
+protected:
+    void write (const void *data, size_t bytes);
+    /* fill the payload, returning the count of its frame */
+    uint32_t keyframe (const Board &board);
+    uint32_t delta (const Board &board);
+
+    FILE *file;
+    const char *path;
+    RecordHeader header;
+    Board last;
+    std::vector<uint64_t> offsets;
+    uint64_t offset;
+    /* the payload of the frame being written */
+    std::vector<uint8_t> payload;
+};
+
+/*
+ * Read a recording through a memory map, so only the frames looked at are
+ * ever paged in.  A recording cut short, without its index, is indexed by
+ * walking its frames.
+ */
+class Replay {
+public:
+    Replay (const char *path);
+    ~Replay ();
+
+    const RecordHeader &header () const;
+    Rule rule () const;
+
+    /* number of generations recorded */
+    unsigned long frames () const;
+
+    /*
+     * Put generation `frame' into `board', which has the size and layers
+     * of the header.  Stepping forward within a keyframe's interval only
+     * applies the deltas since the generation loaded last.
+     */
+    void load (unsigned long frame, Board &board);
+
+protected:
+    const FrameHeader *frame_at (unsigned long frame) const;
+    void invalid () const;
+    void apply (unsigned long frame);
+
+    const char *path;
+    const uint8_t *data;
+    size_t length;
+    std::vector<uint64_t> offsets;
+
+    /* the generation last decoded */
+    Board cache;
+    unsigned long cached;
+};
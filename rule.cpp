@@ -0,0 +1,140 @@
+#include <cstdlib>
+#include "rule.hpp"
+
+Rule::Rule ()
+    : kind(WALK)
+    , birth(0)
+    , survive(count_range(19, MAX_NEIGHBORS))
+    , states(2)
+    , boundary(WALL)
+{ }
+
+int
+Rule::layers () const
+{
+    if (kind != GENERATIONS)
+        return 1;
+    /* dying cells count their age from 1 up to states - 2 */
+    return 1 + (32 - __builtin_clz(states - 2));
+}
+
+/* read a set of counts up to the next '/', ':' or the end */
+static bool
+parse_set (const char *&p, uint32_t &set)
+{
+    set = 0;
+    while (*p && *p != '/' && *p != ':') {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (end == p)
+            return false;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(++p, &end, 10);
+            if (end == p)
+                return false;
+            p = end;
+        }
+        if (lo < 0 || hi > MAX_NEIGHBORS || lo > hi)
+            return false;
+        set |= count_range(lo, hi);
+
+        if (*p == ',')
+            p++;
+    }
+    return true;
+}
+
+/* read the boundary after a rule, if it has one, up to the end */
+static bool
+parse_boundary (const char *p, Rule &rule)
+{
+    if (!*p)
+        return true;
+    if (*p++ != ':' || !*p || p[1])
+        return false;
+    switch (*p) {
+        case 'P': rule.boundary = Rule::WALL; return true;
+        case 'T': rule.boundary = Rule::TORUS; return true;
+        case 'M': rule.boundary = Rule::MIRROR; return true;
+    }
+    return false;
+}
+
+bool
+parse_rule (const char *text, Rule &rule)
+{
+    const char *p = text;
+    Rule r;
+
+    if (*p == 'W') {
+        p++;
+        r.kind = Rule::WALK;
+        if (!parse_set(p, r.survive) || !parse_boundary(p, r))
+            return false;
+        rule = r;
+        return true;
+    }
+
+    r.kind = Rule::LIFE;
+    if (*p++ != 'B' || !parse_set(p, r.birth))
+        return false;
+    if (*p++ != '/' || *p++ != 'S' || !parse_set(p, r.survive))
+        return false;
+    /* a board which is born everywhere at once isn't worth stepping */
+    if (r.birth & 1)
+        return false;
+
+    if (*p == '/') {
+        char *end;
+        if (*++p != 'C')
+            return false;
+        r.kind = Rule::GENERATIONS;
+        r.states = strtol(++p, &end, 10);
+        if (end == p || r.states < 3 || r.states > MAX_STATES)
+            return false;
+        p = end;
+    }
+    if (!parse_boundary(p, r))
+        return false;
+
+    rule = r;
+    return true;
+}
+
+static std::string
+format_set (uint32_t set)
+{
+    std::string text;
+    for (int n = 0; n <= MAX_NEIGHBORS; n++) {
+        if (!(set >> n & 1))
+            continue;
+        int hi = n;
+        while (hi < MAX_NEIGHBORS && (set >> (hi + 1) & 1))
+            hi++;
+
+        if (!text.empty())
+            text += ',';
+        text += std::to_string(n);
+        if (hi > n)
+            text += '-' + std::to_string(hi);
+        n = hi;
+    }
+    return text;
+}
+
+std::string
+format_rule (const Rule &rule)
+{
+    static const char *boundaries[] = { "", ":T", ":M" };
+    std::string text;
+
+    if (rule.kind == Rule::WALK)
+        return "W" + format_set(rule.survive) + boundaries[rule.boundary];
+
+    text = "B" + format_set(rule.birth) + "/S" + format_set(rule.survive);
+    if (rule.kind == Rule::GENERATIONS)
+        text += "/C" + std::to_string(rule.states);
+    return text + boundaries[rule.boundary];
+}
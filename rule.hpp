@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+/* neighbor counts run from 0 to 26 */
+#define MAX_NEIGHBORS 26
+/* the most states a Generations rule may have */
+#define MAX_STATES    256
+
+/*
+ * How cells are born, survive and die, written as
+ *
+ *     W19-26        living cells with 19 to 26 neighbors survive in place
+ *                   and every other living cell moves one cell at random
+ *     B5/S4-5       3D Life: dead cells with 5 neighbors are born and living
+ *                   cells with 4 or 5 survive
+ *     B4/S4/C5      Generations: as Life, but a living cell which doesn't
+ *                   survive takes 3 more steps through the states 2, 3 and
+ *                   4 before it is dead, and can't be born meanwhile
+ *
+ * Sets of counts are lists of numbers and ranges like 1,3,5-7.  `birth' and
+ * `survive' hold bit n for every count n in the set.
+ *
+ * Any rule may end in what lies past the edges of the board:
+ *
+ *     W19-26        a dead wall, cells across the edge are always dead
+ *     W19-26:T      a torus, each edge wraps around to the opposite one
+ *     W19-26:M      a mirror, cells across the edge are those on it
+ *
+ * Cells which move off an edge wrap around on a torus and stay where they
+ * are at a mirror, and can't move along that axis at a wall.
+ */
+struct Rule {
+    enum { WALK, LIFE, GENERATIONS };
+    enum { WALL, TORUS, MIRROR };
+
+    int kind;
+    uint32_t birth;
+    uint32_t survive;
+    /* states of a cell, counting dead and living */
+    int states;
+    int boundary;
+
+    /* the rule of the board before rules could be chosen, W19-26 */
+    Rule ();
+
+    /* bit layers a board needs for the states of this rule */
+    int layers () const;
+};
+
+/* the set of counts from lo to hi */
+constexpr uint32_t
+count_range (int lo, int hi)
+{
+    return lo > hi ? 0 : (1u << lo) | count_range(lo + 1, hi);
+}
+
+/* read a rule, returning false if it isn't one */
+bool parse_rule (const char *text, Rule &rule);
+
+/* write a rule the way parse_rule reads it */
+std::string format_rule (const Rule &rule);
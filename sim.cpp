@@ -0,0 +1,112 @@
+#include <chrono>
+#include "sim.hpp"
+
+/* how long the simulation sleeps while it has nothing to step */
+#define IDLE_MS 1
+
+Simulation::Simulation (const Board &first, const Rule &rule,
+                        ThreadPool *pool, uint64_t seed,
+                        Recorder *recorder)
+    : history(2, first.size_x, first.size_y, first.size_z, rule)
+    , pool(pool)
+    , seed(seed)
+    , recorder(recorder)
+    , published(Snapshot(first))
+    , edit_head(0)
+    , edit_tail(0)
+    , running(false)
+    , requested(0)
+    , quit(false)
+{
+    history.current().copy(first);
+    thread = std::thread(&Simulation::run, this);
+}
+
+Simulation::~Simulation ()
+{
+    quit = true;
+    thread.join();
+}
+
+void
+Simulation::play (bool playing)
+{
+    running = playing;
+}
+
+bool
+Simulation::playing () const
+{
+    return running;
+}
+
+void
+Simulation::request_step ()
+{
+    requested++;
+}
+
+void
+Simulation::edit (int x, int y, int z, int state)
+{
+    unsigned head = edit_head.load(std::memory_order_relaxed);
+    if (head - edit_tail.load(std::memory_order_acquire) == EDIT_RING)
+        return;
+
+    Edit &e = edits[head % EDIT_RING];
+    e.x = x;
+    e.y = y;
+    e.z = z;
+    e.state = state;
+    edit_head.store(head + 1, std::memory_order_release);
+}
+
+const Snapshot *
+Simulation::take ()
+{
+    if (!published.take())
+        return NULL;
+    return &published.read_buffer();
+}
+
+void
+Simulation::apply_edits ()
+{
+    unsigned tail = edit_tail.load(std::memory_order_relaxed);
+    unsigned head = edit_head.load(std::memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        Edit &e = edits[tail % EDIT_RING];
+        history.current().set(e.x, e.y, e.z, e.state);
+    }
+    edit_tail.store(tail, std::memory_order_release);
+}
+
+void
+Simulation::run ()
+{
+    while (!quit) {
+        apply_edits();
+
+        if (!running && requested == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+            continue;
+        }
+        if (requested > 0)
+            requested--;
+
+        /* the same moves for a seed as stepping on the drawing thread */
+        if (pool)
+            history.step(*pool, seed + history.generation());
+        else
+            history.step();
+
+        if (recorder)
+            recorder->record(history.current());
+
+        Snapshot &out = published.write_buffer();
+        out.board.copy_chunks(history.current());
+        out.generation = history.generation();
+        published.publish();
+    }
+}
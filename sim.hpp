@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "board.hpp"
+#include "pool.hpp"
+#include "record.hpp"
+
+/* cell edits which can wait for the simulation at once */
+#define EDIT_RING 256
+
+/*
+ * Three buffers shared by one writer and one reader without locks.  The
+ * writer fills the back buffer and publishes it by swapping it with the
+ * middle one, and the reader takes the middle one by swapping it with the
+ * front buffer when something new was published.  Neither ever waits for
+ * the other, and the reader always gets the newest buffer published.
+ */
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer (const T &init)
+        : buffers(3, init)
+        , middle(1)
+        , back(0)
+        , front(2)
+    { }
+
+    /* the buffer the writer fills */
+    T &
+    write_buffer ()
+    {
+        return buffers[back];
+    }
+
+    void
+    publish ()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    /* take the newest published buffer, if there is one since the last */
+    bool
+    take ()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    /* the buffer the reader took last */
+    const T &
+    read_buffer () const
+    {
+        return buffers[front];
+    }
+
+protected:
+    enum { INDEX = 3, FRESH = 4 };
+
+    std::vector<T> buffers;
+    /* index of the middle buffer and whether it was published unread */
+    std::atomic<int> middle;
+    int back;
+    int front;
+};
+
+/* a generation handed from the simulation to whoever draws it */
+struct Snapshot {
+    Board board;
+    unsigned long generation;
+
+    Snapshot (const Board &board)
+        : board(board)
+        , generation(0)
+    { }
+};
+
+/*
+ * The board stepped on a thread of its own, as fast as it can while
+ * playing or a generation at a time on request.  Every generation is
+ * published through a TripleBuffer, so the thread drawing the board never
+ * waits on a step and a step never waits on a frame.  Cell edits are passed
+ * to the simulation through a ring and made before its next step.
+ *
+ * With a recorder every generation stepped is recorded on the simulation's
+ * thread as well.
+ *
+ * Only one thread may call the methods of a Simulation.
+ */
+class Simulation {
+public:
+    /* step from `first' by `rule', across `pool' if there is one */
+    Simulation (const Board &first, const Rule &rule, ThreadPool *pool,
+                uint64_t seed, Recorder *recorder = NULL);
+    ~Simulation ();
+
+    /* step continuously or not */
+    void play (bool playing);
+    bool playing () const;
+
+    /* step one more generation while not playing */
+    void request_step ();
+
+    /* set a cell of the newest generation, dropped if the ring is full */
+    void edit (int x, int y, int z, int state);
+
+    /*
+     * Take the newest generation published since the last call, if there
+     * is one.  It stays valid until the next call.
+     */
+    const Snapshot *take ();
+
+protected:
+    struct Edit {
+        int x, y, z;
+        int state;
+    };
+
+    void run ();
+    void apply_edits ();
+
+    History history;
+    ThreadPool *pool;
+    uint64_t seed;
+    Recorder *recorder;
+    TripleBuffer<Snapshot> published;
+
+    Edit edits[EDIT_RING];
+    /* edits are written at head and read at tail, both only growing */
+    std::atomic<unsigned> edit_head;
+    std::atomic<unsigned> edit_tail;
+
+    std::atomic<bool> running;
+    std::atomic<int> requested;
+    std::atomic<bool> quit;
+    std::thread thread;
+};
@@ -0,0 +1,8 @@
+#pragma once
+/* the vector math of GLM, without the window and OpenGL draw.hpp brings */
+#define GLM_SWIZZLE
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/euler_angles.hpp>
+#include <glm/gtc/type_ptr.hpp>